@@ -1,5 +1,6 @@
 #ifndef BOOTROM_HPP
 #define BOOTROM_HPP
+#include "platform.hpp"
 
 // ブート用ROM
 // ROMデータは下記のものを使用、
@@ -53,6 +54,10 @@ class BootRom{
         inline uint8_t read(uint16_t addr){
             return pgm_read_byte(&rom[addr]);
         }
+        // ページテーブル用、ROMデータのポインタ
+        inline const uint8_t *get_ptr(){
+            return rom;
+        }
         inline void write(uint16_t addr, uint8_t val){
             if (val != 0) this->active = false;
         }
@@ -1,7 +1,9 @@
 #ifndef CARTRIDGE_HPP
 #define CARTRIDGE_HPP
-#include <Arduino.h>
+#include "platform.hpp"
 #include "mbc.hpp"
+#include "rom_cache.hpp"
+#include "save_ram.hpp"
 
 // ソフトの構造体
 struct CartridgeHeader {
@@ -27,19 +29,28 @@ class Cartridge {
     private:
         uint32_t rom_size = 0;
         uint32_t sram_size = 0;
-        uint8_t bank_size = 0;
-        uint8_t *sram;
-        uint8_t *p_rom;
+        uint16_t bank_size = 0;
+        uint16_t rtc_frames = 0;            // RTCの値を保存し直してからのフレーム数
+        RomCache *p_cache;
+        RomCache memory_cache;              // ROM全体がメモリ上にある場合に使う
         Mbc mbc;
 
     public:
         //
         CartridgeHeader header;
+        SaveRam save_ram;                   // SRAM、バッテリーバックアップ有りの場合は書き込みを記録する
         //
-        inline void loadRom(uint8_t *pRom){
-            this->p_rom = pRom;
+        // ROM全体がメモリ上にある場合（フラッシュに埋め込んだROM・mmapしたファイルなど）、コピーせずに参照する
+        inline void loadRom(const uint8_t *pRom, uint32_t size){
+            this->memory_cache.open_memory(pRom, size);
+            this->loadRom(&this->memory_cache);
+        }
+
+        // バンク単位で読み込む場合、キャッシュはバンク0を読み込み済みであること
+        inline void loadRom(RomCache *p_cache){
+            this->p_cache = p_cache;
 
-            memcpy(&this->header, &pRom[0x100], 0x50);                      // ヘッダ情報のコピー
+            memcpy(&this->header, &p_cache->bank_ptr(0)[0x100], 0x50);      // ヘッダ情報のコピー
             this->rom_size = 1 << (15 + this->header.rom_size);             // ROM容量
             switch (this->header.sram_size) {                               // ROM内臓SRAM
                 case 0x00: this->sram_size = 0; break;
@@ -49,39 +60,130 @@ class Cartridge {
                 case 0x04: this->sram_size = 0x20000; break;
                 case 0x05: this->sram_size = 0x10000; break;
             }
-            this->sram = new uint8_t[this->sram_size];
+            // MBC2はヘッダに関わらず512 × 4bitのRAMを内蔵する
+            if(this->header.cartridge_type == 0x05 || this->header.cartridge_type == 0x06) this->sram_size = MBC2_RAM_SIZE;
+            this->save_ram.setup(this->sram_size, this->has_battery(), this->has_rtc() ? RTC_SAVE_SIZE : 0);
             this->bank_size = this->rom_size >> 14;                         // ROMバンクは1つあたり16KB
-            this->mbc.setup(this->header.cartridge_type, this->bank_size);
+            this->mbc.setup(this->header.cartridge_type, this->bank_size, p_cache, this->save_ram.data, this->sram_size);
+        }
+
+        // SRAMがバッテリーバックアップされているカートリッジか
+        inline bool has_battery(){
+            switch (this->header.cartridge_type) {
+                case 0x03:      // MBC1+RAM+BATTERY
+                case 0x06:      // MBC2+BATTERY
+                case 0x09:      // ROM+RAM+BATTERY
+                case 0x0F:      // MBC3+TIMER+BATTERY
+                case 0x10:      // MBC3+TIMER+RAM+BATTERY
+                case 0x13:      // MBC3+RAM+BATTERY
+                case 0x1B:      // MBC5+RAM+BATTERY
+                case 0x1E:      // MBC5+RUMBLE+RAM+BATTERY
+                    return true;
+                default:
+                    return false;
+            }
+        }
+
+        // MBC3のRTCを持つカートリッジか
+        inline bool has_rtc(){
+            return this->header.cartridge_type == 0x0F || this->header.cartridge_type == 0x10;
+        }
+
+        // セーブファイルからSRAMを読み込む、読めなかった場合は false
+        // RTCは clock から時刻を取得し、wall_clock の場合はセーブファイルの末尾に保存した時刻からの経過時間だけ進める
+        inline bool load_save(RomReader reader, void *ctx, RtcClock clock, bool wall_clock){
+            bool _loaded = this->save_ram.load(reader, ctx);
+            if(this->has_rtc()){
+                uint8_t *_p = &this->save_ram.data[this->save_ram.size];
+                this->mbc.rtc.setup(clock, wall_clock);
+                this->mbc.rtc.load(_p);
+                this->mbc.rtc.save(_p);
+            }
+            return _loaded;
+        }
+
+        // 1フレーム毎に呼び出し、保存する時点であればSRAMを core1 に受け渡す
+        // RTCの値はSRAMを受け渡す度と RTC_SAVE_FRAMES 毎に書き直し、電源を切った場合に戻る時間を抑える
+        inline bool end_frame(){
+            if(this->has_rtc() && this->save_ram.battery){
+                if(++this->rtc_frames >= RTC_SAVE_FRAMES || this->save_ram.due()){
+                    this->rtc_frames = 0;
+                    this->mbc.rtc.save(&this->save_ram.data[this->save_ram.size]);
+                    this->save_ram.touch(this->save_ram.size);
+                }
+            }
+            return this->save_ram.end_frame();
+        }
+
+        // RTCへの書き込みをセーブファイルの末尾に反映する
+        inline void store_rtc(){
+            this->mbc.rtc.changed = false;
+            if(!this->save_ram.battery || !this->has_rtc()) return;
+            this->mbc.rtc.save(&this->save_ram.data[this->save_ram.size]);
+            this->save_ram.mark(this->save_ram.size);
         }
 
         // Read
         inline uint8_t read(uint16_t addr) {
-            if(0x0000 <= addr && addr <= 0x7FFF) {
-                return this->p_rom[this->mbc.get_addr(addr)];
-            } 
+            if(0x0000 <= addr && addr <= 0x3FFF) return this->mbc.rom0[addr];
+            else if(0x4000 <= addr && addr <= 0x7FFF) return this->mbc.romx[addr & 0x3FFF];
             else if(0xA000 <= addr && addr <= 0xBFFF) {
-                switch(this->mbc.mbc){
-                    case MbcType::NoMbc:
-                        return this->sram[addr];
-                    case MbcType::Mbc1:
-                        if(this->mbc.sram_enable) return this->sram[this->mbc.get_addr(addr)];
-                        else return 0xFF;
-                }
+                uint8_t *_p = this->sram_ptr(addr);
+                if(_p != nullptr) return *_p;
+                return this->mbc.read_ram(addr);
             }
             return 0xFF;
         }
 
+        // アドレスに割り当てられているROMバンク番号
+        inline uint16_t rom_bank(uint16_t addr) {
+            return this->mbc.rom_bank(addr);
+        }
+
+        // ページテーブル用、addr（0x0000～0x7FFF）に割り当てられているROMデータのポインタ
+        inline const uint8_t *rom_ptr(uint16_t addr) {
+            return (addr <= 0x3FFF) ? &this->mbc.rom0[addr] : &this->mbc.romx[addr & 0x3FFF];
+        }
+
+        // ページテーブル用、addr（0xA000～0xBFFF）に割り当てられているSRAMのポインタ
+        // SRAMが無効・容量外、またはMBC2の内蔵RAM・MBC3のRTCの場合は nullptr
+        inline uint8_t *sram_ptr(uint16_t addr) {
+            if(this->mbc.sram == nullptr) return nullptr;
+            if(this->mbc.sram_offset + (addr & 0x1FFF) >= this->sram_size) return nullptr;
+            return &this->mbc.sram[addr & 0x1FFF];
+        }
+
+        // ページテーブル用、書き込み先のSRAMのポインタ
+        // バッテリーバックアップ有りの場合は書き込みを記録するため nullptr（write で処理する）
+        inline uint8_t *sram_write_ptr(uint16_t addr) {
+            if(this->save_ram.battery) return nullptr;
+            return this->sram_ptr(addr);
+        }
+
         // Write
         inline void write(uint16_t addr, uint8_t val) {
             if(0x0000 <= addr && addr <= 0x7FFF) {
+                // ゲームはセーブ後にSRAMを無効にするため、その時点で保存する
+                bool _enabled = this->mbc.sram_enable;
                 this->mbc.write(addr, val);
+                if(_enabled && !this->mbc.sram_enable) this->save_ram.request_flush();
             } 
             else if(0xA000 <= addr && addr <= 0xBFFF) {
-                switch(this->mbc.mbc){
-                    case MbcType::NoMbc:
-                        this->sram[addr] = val;
-                    case MbcType::Mbc1:
-                        if(this->mbc.sram_enable) this->sram[this->mbc.get_addr(addr)] = val;
+                // 値が変わらない書き込みは記録しない（同じ内容を毎フレーム書き直すゲームで、ページが保存待ちのままにならないようにする）
+                uint8_t *_p = this->sram_ptr(addr);
+                if(_p != nullptr) {
+                    if(*_p == val) return;
+                    *_p = val;
+                    if(this->save_ram.battery) this->save_ram.mark(_p - this->save_ram.data);
+                } else if(this->mbc.mbc == MbcType::Mbc2) {
+                    // 内蔵RAMは下位4bitのみ保持する
+                    uint16_t _offset = addr & (MBC2_RAM_SIZE - 1);
+                    if(!this->mbc.sram_enable || this->save_ram.data[_offset] == (val & 0x0F)) return;
+                    this->mbc.write_ram(addr, val);
+                    if(this->save_ram.battery) this->save_ram.mark(_offset);
+                } else {
+                    this->mbc.write_ram(addr, val);
+                    if(this->mbc.rtc.changed) this->store_rtc();
                 }
             }
         }
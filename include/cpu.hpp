@@ -1,10 +1,15 @@
 #ifndef CPU_HPP
 #define CPU_HPP
 
+#include <array>
+#include <utility>
 #include "peripherals.hpp"
 #include "registers.hpp"
 #include "interrupts.hpp"
 
+// CPUクロック（Tサイクル / 秒）
+const uint32_t CPU_CLOCK = 4194304;
+
 // enum
 enum class Reg8 {A, B, C, D, E, H, L};
 enum class Reg16 {AF, BC, DE, HL, SP};
@@ -13,785 +18,803 @@ enum class Direct8 {D, DFF};
 enum class Cond {NZ, Z, NC, C};
 enum class Imm8{};
 enum class Imm16{};
+enum class Alu {ADD, ADC, SUB, SBC, AND, XOR, OR, CP};           // alu[y]
+enum class Rot {RLC, RRC, RL, RR, SLA, SRA, SWAP, SRL};         // rot[y]（0xCB命令）
+
+// オペコードのbitフィールド x(7-6bit) y(5-3bit) z(2-0bit) p(5-4bit) q(3bit) からオペランドを引くテーブル
+// r[6] は (HL) を指すため、R_OPERAND で Indirect::HL に置き換える
+constexpr Reg8 R8_TABLE[8] = {Reg8::B, Reg8::C, Reg8::D, Reg8::E, Reg8::H, Reg8::L, Reg8::A, Reg8::A};
+constexpr Reg16 RP_TABLE[4] = {Reg16::BC, Reg16::DE, Reg16::HL, Reg16::SP};     // rp[p]
+constexpr Reg16 RP2_TABLE[4] = {Reg16::BC, Reg16::DE, Reg16::HL, Reg16::AF};    // rp2[p]（push/pop用）
+constexpr Indirect IND_TABLE[4] = {Indirect::BC, Indirect::DE, Indirect::HLI, Indirect::HLD};
+constexpr Cond COND_TABLE[4] = {Cond::NZ, Cond::Z, Cond::NC, Cond::C};
+constexpr Alu ALU_TABLE[8] = {Alu::ADD, Alu::ADC, Alu::SUB, Alu::SBC, Alu::AND, Alu::XOR, Alu::OR, Alu::CP};
+constexpr Rot ROT_TABLE[8] = {Rot::RLC, Rot::RRC, Rot::RL, Rot::RR, Rot::SLA, Rot::SRA, Rot::SWAP, Rot::SRL};
+
+// r[i] のオペランド
+template<uint8_t I> constexpr auto R_OPERAND = R8_TABLE[I];
+template<> constexpr auto R_OPERAND<6> = Indirect::HL;
+
+// 命令長（オペコードを含むバイト数）
+constexpr uint8_t op_length(uint8_t op){
+    uint8_t x = op >> 6, y = (op >> 3) & 7, z = op & 7, q = y & 1;
+    if(x == 0){
+        if(z == 0) return y == 0 ? 1 : (y == 1 ? 3 : 2);        // NOP / LD (nn),SP / STOP, JR
+        if(z == 1) return q == 0 ? 3 : 1;                       // LD rr,nn / ADD HL,rr
+        if(z == 6) return 2;                                    // LD r,n
+    }
+    else if(x == 3){
+        if(z == 0) return y < 4 ? 1 : 2;                        // RET cc / LDH, ADD SP, LD HL,SP+e
+        if(z == 2) return (y < 4 || y == 5 || y == 7) ? 3 : 1;  // JP cc / LD (nn),A, LD A,(nn)
+        if(z == 3) return y == 0 ? 3 : (y == 1 ? 2 : 1);        // JP nn / 0xCB
+        if(z == 4) return y < 4 ? 3 : 1;                        // CALL cc
+        if(z == 5) return y == 1 ? 3 : 1;                       // CALL nn
+        if(z == 6) return 2;                                    // ALU n
+    }
+    return 1;
+}
 
 // struct
 struct Ctx {
     uint8_t opecode;
     bool cb;
-    bool int_flag;
+    bool ei_delay;      // EIの効果は次の命令の実行後から
+    bool halt;          // HALT中
+    uint16_t imm;       // 命令の即値（8bitの場合は下位のみ）
+};
+
+// アイドルループ（VBlank待ちなどのポーリングループ）の検出状態
+// 短い後方ジャンプを見つけたら1周分の副作用を監視し、
+// 書き込みが無く、読み出しがメモリ・LY・STAT・IF・IE・JOYPのみで、1周後のレジスタが同じであれば
+// 次のイベントまで状態が変化しないため、サイクルを周期単位で進める
+const uint8_t IDLE_LOOP_MAX_BYTES = 16;    // 対象とするループの最大バイト数
+struct IdleLoop {
+    uint16_t start;     // ループ先頭（後方ジャンプ先）
+    uint16_t branch;    // 後方ジャンプ命令のアドレス
+    bool probing;       // 監視中、書き込みなどの副作用があれば false にする
+    bool detected;      // アイドルループを確認した
+    uint16_t af;        // ループ先頭のレジスタ
+    uint16_t bc;
+    uint16_t de;
+    uint16_t hl;
+    uint16_t sp;
+    uint64_t cycle;     // ループ先頭のサイクル
+    uint32_t period;    // 1周のサイクル数
+};
+
+class Cpu;
+// 命令ハンドラ、オペコード毎にテンプレートで特殊化される
+typedef void (*OpHandler)(Cpu &cpu, Peripherals &bus);
+
+// デコード済み命令のキャッシュ
+// (バンク, PC) をタグとし、ハンドラと即値を保持する
+// PCの下位bitでインデックスするダイレクトマップ方式、サイズは2の累乗
+#ifndef DECODE_CACHE_SIZE
+#define DECODE_CACHE_SIZE 1024
+#endif
+const uint32_t DECODE_INVALID = 0xFFFFFFFF;
+struct Decoded {
+    uint32_t tag;       // バンク番号 << 16 | PC
+    OpHandler handler;
+    uint16_t imm;
+    uint8_t opecode;
+    uint8_t len;
+    bool cb;
 };
 
 
 class Cpu{
     private:
-        // フェッチ
-        inline void fetch(Peripherals &bus){
-            this->ctx.opecode = bus.read(this->interrupts, this->regs.pc);
-            // 割り込み確認
-            if(this->interrupts.ime && this->interrupts.get_interrupts() > 0){
-                this->ctx.int_flag = true;
-            } else {
-                this->regs.pc += 1;
-                this->ctx.int_flag = false;;
+        uint64_t mcycle_target;     // emulate_cycle で要求されたサイクル数
+        Decoded dcache[DECODE_CACHE_SIZE];
+        Decoded dscratch;           // キャッシュ対象外の領域で使用する
+        uint32_t code_blocks[8];    // 0xC000～0xFFFF を64バイト毎に区切り、キャッシュ済みの命令があるブロックのbitを立てる
+
+        //---------------------------------------------------------------------------------------------
+        // 命令テーブルに格納するハンドラ、オペコード毎に decode / decode_cb を特殊化する
+        template<uint8_t OP, bool CB> static void handler(Cpu &cpu, Peripherals &bus){
+            if constexpr (CB) cpu.decode_cb<OP>(bus);
+            else cpu.decode<OP>(bus);
+        }
+        // 256命令分のハンドラテーブルをコンパイル時に生成する
+        template<bool CB, size_t... OP> static constexpr std::array<OpHandler, 256> make_table(std::index_sequence<OP...>){
+            return {{ &Cpu::handler<(uint8_t)OP, CB>... }};
+        }
+
+        //---------------------------------------------------------------------------------------------
+        // バスアクセス、1回につき1Mサイクル（4Tサイクル）消費
+        inline uint8_t bus_read(Peripherals &bus, uint16_t addr){
+            this->cycle += 4;
+            this->sync(bus);
+            if(this->idle.probing && !this->idle_readable(addr)) this->idle.probing = false;
+            return bus.read(addr);
+        }
+        inline void bus_write(Peripherals &bus, uint16_t addr, uint8_t val){
+            this->cycle += 4;
+            this->sync(bus);
+            this->idle.probing = false;
+            bus.write(addr, val);
+            // 命令をキャッシュしているRAMへの書き込み
+            if(addr >= 0xC000){
+                uint8_t _block = this->code_block(addr);
+                if(this->code_blocks[_block >> 5] & (1u << (_block & 31))) this->invalidate_block(_block);
+            }
+        }
+        // 周辺機器の時刻を進め、期限が来たイベントを処理して割り込みを要求する
+        // イベントが無い間は比較1回のみ
+        inline void sync(Peripherals &bus){
+            bus.now = this->cycle;
+            if(this->cycle >= bus.next_event()){
+                bus.interrupts.irq(bus.service_events());
+                this->idle.probing = false;         // ループの途中で状態が変化した
             }
-            this->ctx.cb = false;
+        }
+        // バスアクセスを伴わない内部処理の1Mサイクル
+        inline void internal_cycle(){
+            this->cycle += 4;
         }
 
-        // 0xCBの場合は16bit命令
-        inline void cb_prefixed(Peripherals &bus) {
-            static uint8_t _val = 0;
-            // プログラムカウンタの値を読む
-            if (this->read8(bus, this->imm8, _val)) {
-                this->ctx.opecode = _val;
-                this->ctx.cb = true;
-                this->cb_decode(bus);
+        //---------------------------------------------------------------------------------------------
+        // アイドルループの検出
+        // ループ中に読み出しても状態が変化しないアドレス
+        // メモリはCPUが書き込まない限り、LY・STAT・IF・JOYPは次のイベントまで変化しない
+        inline bool idle_readable(uint16_t addr){
+            return addr <= 0x7FFF ||                        // ROM
+                   (0xC000 <= addr && addr <= 0xFDFF) ||    // WRAM
+                   (0xFF80 <= addr && addr <= 0xFFFF) ||    // HRAM・IE
+                   addr == 0xFF00 || addr == 0xFF0F ||      // JOYP・IF
+                   addr == 0xFF41 || addr == 0xFF44;        // STAT・LY
+        }
+        // 後方ジャンプ成立時に呼び出す、from はジャンプ命令のアドレス
+        // 前回と同じループを副作用無しで1周し、レジスタも変化していなければアイドルループとする
+        inline void loop_branch(uint16_t from){
+            uint16_t _to = this->regs.pc;
+            if(_to > from || from - _to > IDLE_LOOP_MAX_BYTES) return;
+            IdleLoop &l = this->idle;
+            uint16_t _af = this->regs.af();
+            uint16_t _bc = this->regs.bc();
+            uint16_t _de = this->regs.de();
+            uint16_t _hl = this->regs.hl();
+            if(l.probing && l.start == _to && l.branch == from &&
+               l.af == _af && l.bc == _bc && l.de == _de && l.hl == _hl && l.sp == this->regs.sp){
+                l.detected = true;
+                l.period = (uint32_t)(this->cycle - l.cycle);
+                return;
             }
+            l.start = _to;
+            l.branch = from;
+            l.probing = true;
+            l.detected = false;
+            l.af = _af;
+            l.bc = _bc;
+            l.de = _de;
+            l.hl = _hl;
+            l.sp = this->regs.sp;
+            l.cycle = this->cycle;
         }
-        
 
         //---------------------------------------------------------------------------------------------
-        // 8bitレジスタのR、サイクル消費はしない
-        inline bool read8(Peripherals &bus, Reg8 src, uint8_t &val){
-            switch(src){
-                case Reg8::A: val = this->regs.a; return true;
-                case Reg8::B: val = this->regs.b; return true;
-                case Reg8::C: val = this->regs.c; return true;
-                case Reg8::D: val = this->regs.d; return true;
-                case Reg8::E: val = this->regs.e; return true;
-                case Reg8::H: val = this->regs.h; return true;
-                case Reg8::L: val = this->regs.l; return true;
-            };
-            return false;
+        // 8bitレジスタ、どのレジスタかはコンパイル時に解決される
+        template<Reg8 R> inline uint8_t &reg8(){
+            if constexpr (R == Reg8::A) return this->regs.a;
+            else if constexpr (R == Reg8::B) return this->regs.b;
+            else if constexpr (R == Reg8::C) return this->regs.c;
+            else if constexpr (R == Reg8::D) return this->regs.d;
+            else if constexpr (R == Reg8::E) return this->regs.e;
+            else if constexpr (R == Reg8::H) return this->regs.h;
+            else return this->regs.l;
         }
         // 8bitレジスタのRW、サイクル消費はしない
-        inline bool write8(Peripherals &bus, Reg8 dst, uint8_t val){
-            switch(dst){
-                case Reg8::A: this->regs.a = val; return true;
-                case Reg8::B: this->regs.b = val; return true;
-                case Reg8::C: this->regs.c = val; return true;
-                case Reg8::D: this->regs.d = val; return true;
-                case Reg8::E: this->regs.e = val; return true;
-                case Reg8::H: this->regs.h = val; return true;
-                case Reg8::L: this->regs.l = val; return true;
-            };
-            return false;
-        }
-        // 16bitレジスタのR、サイクル消費はしない
-        inline bool read16(Peripherals &bus, Reg16 src, uint16_t &val){
-            switch(src){
-                case Reg16::AF: val = this->regs.af(); return true;
-                case Reg16::BC: val = this->regs.bc(); return true;
-                case Reg16::DE: val = this->regs.de(); return true;
-                case Reg16::HL: val = this->regs.hl(); return true;
-                case Reg16::SP: val = this->regs.sp; return true;
-            };
-            return false;
-        }
-        // 16bitレジスタのW、サイクル消費はしない
-        inline bool write16(Peripherals &bus, Reg16 src, uint16_t val){
-            switch(src){
-                case Reg16::AF: this->regs.write_af(val); return true;
-                case Reg16::BC: this->regs.write_bc(val); return true;
-                case Reg16::DE: this->regs.write_de(val); return true;
-                case Reg16::HL: this->regs.write_hl(val); return true;
-                case Reg16::SP: this->regs.sp = val; return true;
-            };
-            return false;
+        template<Reg8 R> inline uint8_t load8(Peripherals &bus){
+            return this->reg8<R>();
+        }
+        template<Reg8 R> inline void store8(Peripherals &bus, uint8_t val){
+            this->reg8<R>() = val;
+        }
+        // 16bitレジスタのRW、サイクル消費はしない
+        template<Reg16 R> inline uint16_t load16(Peripherals &bus){
+            if constexpr (R == Reg16::AF) return this->regs.af();
+            else if constexpr (R == Reg16::BC) return this->regs.bc();
+            else if constexpr (R == Reg16::DE) return this->regs.de();
+            else if constexpr (R == Reg16::HL) return this->regs.hl();
+            else return this->regs.sp;
+        }
+        template<Reg16 R> inline void store16(Peripherals &bus, uint16_t val){
+            if constexpr (R == Reg16::AF) this->regs.write_af(val);
+            else if constexpr (R == Reg16::BC) this->regs.write_bc(val);
+            else if constexpr (R == Reg16::DE) this->regs.write_de(val);
+            else if constexpr (R == Reg16::HL) this->regs.write_hl(val);
+            else this->regs.sp = val;
         }
 
         //---------------------------------------------------------------------------------------------
-        // プログラムカウンタが指す場所から読み取られる8bitのR、サイクル1消費
-        inline bool read8(Peripherals &bus, Imm8 src, uint8_t &val){
-            static uint8_t _step = 0;
-
-            switch(_step){
-                case 0:
-                    _step = 1;
-                    return false;
-                case 1:
-                    val = bus.read(this->interrupts, this->regs.pc);
-                    this->regs.pc += 1;
-                    _step = 0;
-                    return true;
-            };
-            return false;
-        }
-        // プログラムカウンタが指す場所から読み取られる16bit、サイクル2消費
-        inline bool read16(Peripherals &bus, Imm16 src, uint16_t &val){
-            static uint8_t _step = 0;
-            uint8_t _tmp;
-
-            switch(_step){
-                case 0:
-                    val = bus.read(this->interrupts, this->regs.pc);
-                    this->regs.pc += 1;
-                    _step = 1;
-                    return false;
-                case 1:
-                    _tmp = bus.read(this->interrupts, this->regs.pc);
-                    this->regs.pc += 1;
-                    val |= _tmp << 8;
-                    _step = 2;
-                    return false;
-                case 2:
-                    _step = 0;
-                    return true;
-            };
-            return false;
+        // プログラムカウンタが指す場所から読み取られる8bit、16bit
+        // 即値は命令のフェッチ時にデコード済みのため、ここではサイクル消費しない
+        template<Imm8 I> inline uint8_t load8(Peripherals &bus){
+            return (uint8_t)this->ctx.imm;
+        }
+        template<Imm16 I> inline uint16_t load16(Peripherals &bus){
+            return this->ctx.imm;
         }
-
 
         //---------------------------------------------------------------------------------------------
-        // 16bitレジスタ、もしくは2つの8bitレジスタからなる16bitが指す場所の8bitを読み取る
+        // 16bitレジスタ、もしくは2つの8bitレジスタからなる16bitが指す場所の8bit
         // サイクル1消費
-        inline bool read8(Peripherals &bus, Indirect src, uint8_t &val){
-            static uint8_t _step = 0;
-
-            switch(_step){
-                case 0:
-                    _step = 1;
-                    return false;
-                case 1:
-                    uint16_t addr = 0;
-                    switch(src){
-                        case Indirect::BC: val = bus.read(this->interrupts, this->regs.bc()); break;
-                        case Indirect::DE: val = bus.read(this->interrupts, this->regs.de()); break;
-                        case Indirect::HL: val = bus.read(this->interrupts, this->regs.hl()); break;
-                        case Indirect::HLD:
-                            // HLの値を読んだ後にデクリメントする
-                            addr = this->regs.hl();
-                            val = bus.read(this->interrupts, addr);
-                            addr -= 1;
-                            this->regs.write_hl(addr); 
-                            break;
-                        case Indirect::HLI:
-                            // HLの値を読んだ後にインクリメントする
-                            addr = this->regs.hl();
-                            val = bus.read(this->interrupts, addr);
-                            addr += 1;
-                            this->regs.write_hl(addr); 
-                            break;
-                    };
-                    _step = 0;
-
-                    return true;
+        template<Indirect I> inline uint16_t indirect_addr(){
+            if constexpr (I == Indirect::BC) return this->regs.bc();
+            else if constexpr (I == Indirect::DE) return this->regs.de();
+            else if constexpr (I == Indirect::HL) return this->regs.hl();
+            else if constexpr (I == Indirect::CFF) return 0xFF00 | this->regs.c;
+            else {
+                // HLの値を使った後にデクリメント（HLD）、インクリメント（HLI）する
+                uint16_t addr = this->regs.hl();
+                this->regs.write_hl(I == Indirect::HLD ? addr - 1 : addr + 1);
+                return addr;
             }
-            return false;
-        }
-        inline bool write8(Peripherals &bus, Indirect dst, uint8_t val){
-            static uint8_t _step = 0;
-
-            switch(_step){
-                case 0:
-                    _step = 1;
-                    return false;
-                case 1:
-                    uint16_t addr = 0;
-                    switch(dst){
-                        case Indirect::BC: bus.write(this->interrupts, this->regs.bc(), val); break;
-                        case Indirect::DE: bus.write(this->interrupts, this->regs.de(), val); break;
-                        case Indirect::HL: bus.write(this->interrupts, this->regs.hl(), val); break;
-                        case Indirect::HLD:
-                            // HLの値を書いた後にデクリメントする
-                            addr = this->regs.hl();
-                            bus.write(this->interrupts, addr, val);
-                            addr -= 1;
-                            this->regs.write_hl(addr); 
-                            break;
-                        case Indirect::HLI:
-                            // HLの値を書いた後にインクリメントする
-                            addr = this->regs.hl();
-                            bus.write(this->interrupts, addr, val);
-                            addr += 1;
-                            this->regs.write_hl(addr); 
-                            break;
-                    };
-
-                    _step = 0;
-                    return true;
-            }
-            return false;
+        }
+        template<Indirect I> inline uint8_t load8(Peripherals &bus){
+            return this->bus_read(bus, this->indirect_addr<I>());
+        }
+        template<Indirect I> inline void store8(Peripherals &bus, uint8_t val){
+            this->bus_write(bus, this->indirect_addr<I>(), val);
         }
 
         //---------------------------------------------------------------------------------------------
-        // プログラムカウンタが指す場所から読み取られる16bitが指す場所から読み取られる8bit
-        // Dだと3サイクル、DEFは2サイクル
-        inline bool read8(Peripherals &bus, Direct8 src, uint8_t &val){
-            static uint8_t _step = 0;
-            static uint8_t _val8 = 0;
-            static uint16_t _val16 = 0;
-            uint8_t _tmp = 0;
-
-            switch(_step){
-                case 0:
-                    if(this->read8(bus, this->imm8, _val8)){
-                        _step = 1;
-                        return false;
-                    }
-                    return false;
-                case 1:
-                    if(src == Direct8::DFF) {
-                        _val16 = 0xFF00 | _val8;
-                        _step = 2;                              // DEFの場合はメモリアクセスが1回少ない
-                        return false;
-                    }
-                    if(this->read8(bus, this->imm8, _tmp)){
-                        _val16 = _tmp << 8 | _val8;
-                        _step = 2;
-                        return false;
-                    }
-                    return false;
-                case 2:
-                    val = bus.read(this->interrupts, _val16);                      // 作成したアドレスの値を読む
-                    _step = 0;
-                    return true;
-            };
-
-            return false;
-        }
-        inline bool write8(Peripherals &bus, Direct8 dst, uint8_t val){
-            static uint8_t _step = 0;
-            static uint8_t _val8 = 0;
-            static uint16_t _val16 = 0;
-            uint8_t _tmp = 0;
-
-            switch(_step){
-                case 0:
-                    if(this->read8(bus, this->imm8, _val8)){
-                        _step = 1;
-                        return false;
-                    }
-                    return false;
-                case 1:
-                    if(dst == Direct8::DFF) {
-                        _val16 = 0xFF00 | _val8;
-                        _step = 2;                              // DEFの場合はメモリアクセスが1回少ない
-                        return false;
-                    }
-                    if(this->read8(bus, this->imm8, _tmp)){
-                        _val16 = _tmp << 8 | _val8;
-                        _step = 2;
-                        return false;
-                    }
-                    return false;
-                case 2:
-                    bus.write(this->interrupts, _val16, val);                      // 作成したアドレスの値書く
-                    _step = 0;
-                    return true;
-            };
-            return false;
-        }
-
-        
-        
+        // プログラムカウンタが指す場所から読み取られる16bitが指す場所の8bit
+        // Dだと3サイクル、DFFは2サイクル
+        template<Direct8 D> inline uint16_t direct_addr(Peripherals &bus){
+            if constexpr (D == Direct8::DFF) return 0xFF00 | this->load8<Imm8{}>(bus);
+            else return this->load16<Imm16{}>(bus);
+        }
+        template<Direct8 D> inline uint8_t load8(Peripherals &bus){
+            return this->bus_read(bus, this->direct_addr<D>(bus));
+        }
+        template<Direct8 D> inline void store8(Peripherals &bus, uint8_t val){
+            this->bus_write(bus, this->direct_addr<D>(bus), val);
+        }
+
+        //---------------------------------------------------------------------------------------------
+        // スタック操作、1バイト毎に1サイクル
+        // SPをデクリメントした後に上位、下位の順に書き込む
+        inline void push16(Peripherals &bus, uint16_t val){
+            this->regs.sp -= 1;
+            this->bus_write(bus, this->regs.sp, (uint8_t)(val >> 8));
+            this->regs.sp -= 1;
+            this->bus_write(bus, this->regs.sp, (uint8_t)(val & 0xFF));
+        }
+        // 下位、上位の順に読んだ後にSPをインクリメントする
+        inline uint16_t pop16(Peripherals &bus){
+            uint8_t _lo = this->bus_read(bus, this->regs.sp);
+            this->regs.sp += 1;
+            uint8_t _hi = this->bus_read(bus, this->regs.sp);
+            this->regs.sp += 1;
+            return (uint16_t)(_hi << 8) | _lo;
+        }
+
+        //---------------------------------------------------------------------------------------------
+        // 条件判定
+        template<Cond C> inline bool cond(){
+            if constexpr (C == Cond::NZ) return !this->regs.zf();       // not Zフラグ
+            else if constexpr (C == Cond::Z) return this->regs.zf();    // Zフラグ
+            else if constexpr (C == Cond::NC) return !this->regs.cf();  // not Cフラグ
+            else return this->regs.cf();                                // Cフラグ
+        }
+
+
         //---------------------------------------------------------------------------------------------
         // NOP命令、何もしない
         inline void nop(Peripherals &bus){
-            this->fetch(bus);
         }
 
         //---------------------------------------------------------------------------------------------
         // ld d s ： s の値を d  に格納する
-        template<typename T, typename U> void ld(Peripherals &bus, T dst, U src){
-            static uint8_t _step = 0;
-            static uint8_t _val8 = 0;
-            switch(_step){
-                case 0:
-                    if(this->read8(bus, src, _val8)){
-                        _step = 1;
-                    }
-                    break;
-                case 1:
-                    if(this->write8(bus, dst, _val8)){
-                        this->fetch(bus);
-                        _step = 0;
-                    }
-                    break;
-            };
-        }
-        template<typename T, typename U> void ld16(Peripherals &bus, T dst, U src){
-            static uint8_t _step = 0;
-            static uint16_t _val16 = 0;
-            switch(_step){
-                case 0:
-                    if(this->read16(bus, src, _val16)) {
-                        _step = 1;
-                    }
-                    break;
-                case 1:
-                    if(this->write16(bus, dst, _val16)){
-                        this->fetch(bus);
-                        _step = 0;
-                    }
-                    break;
-            };
+        template<auto D, auto S> void ld(Peripherals &bus){
+            this->store8<D>(bus, this->load8<S>(bus));
+        }
+        template<auto D, auto S> void ld16(Peripherals &bus){
+            this->store16<D>(bus, this->load16<S>(bus));
+        }
+        // LD (nn),SP
+        inline void ld_direct_sp(Peripherals &bus){
+            uint16_t _addr = this->load16<Imm16{}>(bus);
+            this->bus_write(bus, _addr, (uint8_t)(this->regs.sp & 0xFF));
+            this->bus_write(bus, _addr + 1, (uint8_t)(this->regs.sp >> 8));
+        }
+        // LD SP,HL
+        inline void ld_sp_hl(Peripherals &bus){
+            this->regs.sp = this->regs.hl();
+            this->internal_cycle();
         }
 
         //---------------------------------------------------------------------------------------------
-        // CP s : Aレジスタからsの値を引き、レジスタ設定を行う
-        template<typename T> void cp(Peripherals &bus, T src){
-            static uint8_t _val8 = 0;
-
-            if(this->read8(bus, src, _val8)){
-                uint8_t _result = this->regs.a - _val8; 
-                // フラグ設定
-                this->regs.set_zf(_result == 0);                             // 演算結果が0の場合は1
-                this->regs.set_nf(true);                                     // 無条件にtrue
-                this->regs.set_hf((this->regs.a & 0xf) < (_val8 & 0xf));      // 4bit目からの繰り下がりが発生した場合に1
-                this->regs.set_cf(this->regs.a < _val8);                      // 8bit目からの繰り下がりが発生した場合に1
-                this->fetch(bus);
-            }
+        // SP + 符号付き8bit、フラグは下位8bitの加算で決まる
+        inline uint16_t sp_offset(Peripherals &bus){
+            uint8_t _val8 = this->load8<Imm8{}>(bus);
+            uint16_t _sp = this->regs.sp;
+            this->regs.set_zf(false);
+            this->regs.set_nf(false);
+            this->regs.set_hf((_sp & 0xF) + (_val8 & 0xF) > 0xF);
+            this->regs.set_cf((_sp & 0xFF) + _val8 > 0xFF);
+            return _sp + (int8_t)_val8;
+        }
+        // ADD SP,e
+        inline void add_sp(Peripherals &bus){
+            this->regs.sp = this->sp_offset(bus);
+            this->internal_cycle();
+            this->internal_cycle();
+        }
+        // LD HL,SP+e
+        inline void ld_hl_sp(Peripherals &bus){
+            this->regs.write_hl(this->sp_offset(bus));
+            this->internal_cycle();
         }
 
         //---------------------------------------------------------------------------------------------
-        // bit num s : s の num bit目が0か1かを確認する
-        template<typename T> void chkbit(Peripherals &bus, uint8_t bitsize, T src){
-            static uint8_t _val8 = 0;
-            if(this->read8(bus, src, _val8)){
-                _val8 &= 1 << bitsize;
-                this->regs.set_zf(_val8 == 0);      // Zフラグ、指定bitが0の場合は1にする
-                this->regs.set_nf(false);           // Nフラグ、無条件に0
-                this->regs.set_hf(true);            // Hフラグ、無条件に1
-                this->fetch(bus);
+        // 8bit演算 : Aレジスタと val の演算結果をAレジスタに格納する（CPは格納しない）
+        template<Alu OP> inline void alu(uint8_t val){
+            uint8_t _a = this->regs.a;
+            if constexpr (OP == Alu::ADD || OP == Alu::ADC) {
+                uint8_t _c = (OP == Alu::ADC) ? (uint8_t)this->regs.cf() : 0;
+                uint16_t _result = _a + val + _c;
+                this->regs.flags_add(_a, val, _result);
+                this->regs.a = (uint8_t)_result;
+            } else if constexpr (OP == Alu::SUB || OP == Alu::SBC || OP == Alu::CP) {
+                uint8_t _c = (OP == Alu::SBC) ? (uint8_t)this->regs.cf() : 0;
+                uint16_t _result = _a - val - _c;                           // 繰り下がりで上位bitが立つ
+                this->regs.flags_sub(_a, val, _result);
+                if constexpr (OP != Alu::CP) this->regs.a = (uint8_t)_result;
+            } else {
+                if constexpr (OP == Alu::AND) _a &= val;
+                else if constexpr (OP == Alu::XOR) _a ^= val;
+                else _a |= val;
+                this->regs.flags_logic(_a, OP == Alu::AND);                 // HはANDのみ1
+                this->regs.a = _a;
             }
         }
+        template<Alu OP, auto S> void alu_op(Peripherals &bus){
+            this->alu<OP>(this->load8<S>(bus));
+        }
 
         //---------------------------------------------------------------------------------------------
         // dec : sをデクリメント
-        // 8bitの場合
-        template<typename T> bool dec(Peripherals &bus, T src){
-            static uint8_t _step = 0;
-            static uint8_t _val8 = 0;
-            static uint8_t _result = 0;
-
-            RE_ACTION:
-            switch(_step){
-                case 0:
-                    if(this->read8(bus, src, _val8)){
-                        // デクリメント
-                        _result = _val8 - 1;
-                        // フラグ操作
-                        this->regs.set_zf(_result == 0);        // Zフラグ、演算結果が0の場合は1
-                        this->regs.set_nf(false);               // Nフラグ、無条件に0
-                        this->regs.set_hf(_val8 & 0xF == 0);    // Hフラグ、4bit目からの繰り下がりが発生すると1
-                        _step = 1;
-                        goto RE_ACTION;
-                    }
-                    return false;
-                case 1:
-                    if(this->write8(bus, src, _result)){
-                        _step = 0;
-                        this->fetch(bus);
-                        return true;
-                    }
-                    return false;
-            };
-            return false;
+        template<auto S> void dec(Peripherals &bus){
+            uint8_t _val8 = this->load8<S>(bus);
+            uint8_t _result = _val8 - 1;
+            this->regs.flags_dec(_val8, _result);
+            this->store8<S>(bus, _result);
+        }
+        template<Reg16 R> void dec16(Peripherals &bus){
+            this->store16<R>(bus, this->load16<R>(bus) - 1);
+            this->internal_cycle();
         }
 
         //---------------------------------------------------------------------------------------------
         // INC s : sをインクリメントする
-        // 8bit操作の時はフラグレジスタ操作も必要
-        template<typename T> bool inc(Peripherals &bus, T src){
-            static uint8_t _step = 0;
-            static uint8_t _val8 = 0;
-            static uint8_t _result = 0;
-
-            RE_ACTION:
-            switch(_step){
-                case 0:
-                    if(this->read8(bus, src, _val8)){
-                        // インクリメント
-                        _result = _val8 + 1;
-                        // フラグ操作
-                        this->regs.set_zf(_result == 0);            // Zフラグ、演算結果が0の場合は1
-                        this->regs.set_nf(false);                   // Nフラグ、無条件に0
-                        this->regs.set_hf(_val8 & 0xF == 0xF);      // Hフラグ、3bit目で繰り上がりが発生すると1
-                        _step = 1;
-                        goto RE_ACTION;
-                    }
-                    return false;
-                case 1:
-                    if(this->write8(bus, src, _result)){
-                        _step = 0;
-                        this->fetch(bus);
-                        return true;
-                    }
-                    return false;
-            };
-            return false;
-        }
-
-        template<typename T> bool inc16(Peripherals &bus, T src){
-            static uint8_t _step = 0;
-            static uint16_t _val16 = 0;
-
-            RE_ACTION:
-            switch(_step){
-                case 0:
-                    if(this->read16(bus, src, _val16)){
-                        // インクリメント
-                        _val16 += 1;
-                        _step = 1;
-                        goto RE_ACTION;
-                    }
-                    return false;
-                case 1:
-                    if(this->write16(bus, src, _val16)){
-                        _step = 0;
-                        this->fetch(bus);
-                        return true;
-                    }
-                    return false;
-            };
-            return false;
+        template<auto S> void inc(Peripherals &bus){
+            uint8_t _val8 = this->load8<S>(bus);
+            uint8_t _result = _val8 + 1;
+            this->regs.flags_inc(_val8, _result);
+            this->store8<S>(bus, _result);
+        }
+        template<Reg16 R> void inc16(Peripherals &bus){
+            this->store16<R>(bus, this->load16<R>(bus) + 1);
+            this->internal_cycle();
         }
 
         //---------------------------------------------------------------------------------------------
-        // RL s : sの値とCフラグを合わせた9bitの値を左に回転 = 1bit左シフト、Cフラグを最下位bitにセットする
-        template<typename T> bool rl(Peripherals &bus, T src){
-            static uint8_t _step = 0;
-            static uint8_t _val8 = 0;
-            static uint8_t _result = 0;
-
-            RE_ACTION:
-            switch(_step){
-                case 0:
-                    // src の値を取得する
-                    if(this->read8(bus, src, _val8)){
-                        // Cフラグを左シフトし、srcとのorをとる
-                        _result = _val8 << 1 | (uint8_t)this->regs.cf();
-                        // フラグ操作
-                        this->regs.set_zf(_result == 0);        // 演算結果が0の場合は1
-                        this->regs.set_nf(0);                   // 無条件に0
-                        this->regs.set_hf(0);                   // 無条件に0
-                        this->regs.set_cf((_val8 & 0x80) > 0);  // 演算前のsrcで7bit目が1の場合は1
-                        _step = 1;
-                        goto RE_ACTION;
-                    }
-                    return false;
-                case 1:
-                    // 値の書き込み
-                    if(this->write8(bus, src, _result)){
-                        _step = 0;
-                        this->fetch(bus);
-                        return true;
-                    }
-                    return false;
-            };
-            return false;
+        // ADD HL,rr : Zフラグは変化しない、H・Cは11bit目・15bit目からの繰り上がり
+        template<Reg16 R> void add_hl(Peripherals &bus){
+            uint16_t _hl = this->regs.hl();
+            uint16_t _val16 = this->load16<R>(bus);
+            uint32_t _result = _hl + _val16;
+            this->regs.set_nf(false);
+            this->regs.set_hf((_hl & 0xFFF) + (_val16 & 0xFFF) > 0xFFF);
+            this->regs.set_cf(_result > 0xFFFF);
+            this->regs.write_hl((uint16_t)_result);
+            this->internal_cycle();
         }
 
         //---------------------------------------------------------------------------------------------
-        // push ：　16bitの値を、スタックポインタをデクリメントした後にスタックポインタが指すアドレスに値を格納する
-        // 3サイクル
-        inline bool push16(Peripherals &bus, uint16_t val){
-            static uint8_t _step = 0;
-
-            switch(_step){
-                case 0:
-                    // メモリアクセス回数 + 1
-                    _step = 1;
-                    return false;
-                case 1:
-                    // SPをデクリメントし、SPが指すアドレスに値を書き込む（H）
-                    this->regs.sp -= 1;
-                    bus.write(this->interrupts, this->regs.sp, (uint8_t)(val >> 8));
-                    _step = 2;
-                    return false;
-                case 2:
-                    // 下位ビット
-                    this->regs.sp -= 1;
-                    bus.write(this->interrupts, this->regs.sp, (uint8_t)(val & 0xFF));
-                    _step = 3;
-                    return false;
-                case 3:
-                    _step = 0;
-                    return true;
-            }
-            return false;
+        // シフト・回転、Cフラグには押し出されたbitが入る
+        template<Rot OP> inline uint8_t rot(uint8_t val){
+            uint8_t _result = 0;
+            bool _carry = false;
+            if constexpr (OP == Rot::RLC) { _result = (val << 1) | (val >> 7); _carry = val & 0x80; }
+            else if constexpr (OP == Rot::RRC) { _result = (val >> 1) | (val << 7); _carry = val & 1; }
+            else if constexpr (OP == Rot::RL) { _result = (val << 1) | (uint8_t)this->regs.cf(); _carry = val & 0x80; }
+            else if constexpr (OP == Rot::RR) { _result = (val >> 1) | ((uint8_t)this->regs.cf() << 7); _carry = val & 1; }
+            else if constexpr (OP == Rot::SLA) { _result = val << 1; _carry = val & 0x80; }
+            else if constexpr (OP == Rot::SRA) { _result = (val >> 1) | (val & 0x80); _carry = val & 1; }
+            else if constexpr (OP == Rot::SWAP) { _result = (val << 4) | (val >> 4); _carry = false; }
+            else { _result = val >> 1; _carry = val & 1; }
+            this->regs.flags_rot(_result, _carry);
+            return _result;
+        }
+        template<Rot OP, auto S> void rot_op(Peripherals &bus){
+            this->store8<S>(bus, this->rot<OP>(this->load8<S>(bus)));
+        }
+        // RLCA, RRCA, RLA, RRA : Aレジスタ専用、Zフラグは常に0
+        template<Rot OP> void rot_a(Peripherals &bus){
+            this->regs.a = this->rot<OP>(this->regs.a);
+            this->regs.set_zf(false);
         }
-        // 4サイクル固定
-        inline bool push(Peripherals &bus, Reg16 src){
-            static uint8_t _step = 0;
-            static uint16_t _val16 = 0;
-
-            RE_ACTION:
-            switch(_step){
-                case 0:
-                    // 16bitの値取得
-                    this->read16(bus, src, _val16);
-                    _step = 1;
-                    goto RE_ACTION;
-                case 1:
-                    // プログラムカウンタの値をpush（3サイクル）
-                    if(this->push16(bus, _val16)){
-                        _step = 2;
-                        goto RE_ACTION;
-                    }
-                    return false;
-                case 2:
-                    _step = 0;
-                    this->fetch(bus);
-                    return true;
-            }
-            return false;
+
+        //---------------------------------------------------------------------------------------------
+        // bit num s : s の num bit目が0か1かを確認する
+        template<uint8_t N, auto S> void chkbit(Peripherals &bus){
+            uint8_t _val8 = this->load8<S>(bus) & (1 << N);
+            this->regs.flags_bit(_val8);        // 指定bitが0の場合にZフラグが立つ
+        }
+        // res num s : s の num bit目を0にする
+        template<uint8_t N, auto S> void resbit(Peripherals &bus){
+            this->store8<S>(bus, this->load8<S>(bus) & ~(1 << N));
+        }
+        // set num s : s の num bit目を1にする
+        template<uint8_t N, auto S> void setbit(Peripherals &bus){
+            this->store8<S>(bus, this->load8<S>(bus) | (1 << N));
         }
 
         //---------------------------------------------------------------------------------------------
-        // pop : 16bitの値をスタックからpop
-        // スタックポインタが指すアドレスに格納されている値をレジスタに格納した後に，スタックポインタをインクリメント
-        inline bool pop16(Peripherals &bus, uint16_t &val){
-            static uint8_t _step = 0;
-            static uint8_t _lo = 0, _hi = 0;
-
-            switch(_step){
-                case 0:
-                    // 下位8bitの値取得し、SPをインクリメント
-                    _lo = bus.read(this->interrupts, this->regs.sp);
-                    this->regs.sp += 1;
-                    _step = 1;
-                    break;
-                case 1:
-                    // 上位8bitの値取得し、SPをインクリメント
-                    _hi = bus.read(this->interrupts, this->regs.sp);
-                    this->regs.sp += 1;
-                    // 結果代入
-                    val = (uint16_t)(_hi << 8) | (uint16_t)_lo; 
-                    _step = 2;
-                    break;
-                case 2:
-                    _step = 0;
-                    return true;
-            };
-
-            return false;
-        }
-        inline bool pop(Peripherals &bus, Reg16 dst){
-            static uint16_t _val = 0;
-            
-            if(this->pop16(bus, _val)){
-                // 取り出した値をレジスタに書き込み、サイクル消費しない
-                this->write16(bus, dst, _val);
-                this->fetch(bus);
-                return true;
+        // DAA : 直前の演算結果をBCDに補正する
+        inline void daa(Peripherals &bus){
+            uint8_t _a = this->regs.a;
+            bool _carry = this->regs.cf();
+            if(!this->regs.nf()){
+                if(_carry || _a > 0x99){ _a += 0x60; _carry = true; }
+                if(this->regs.hf() || (_a & 0xF) > 0x9) _a += 0x06;
+            } else {
+                if(_carry) _a -= 0x60;
+                if(this->regs.hf()) _a -= 0x06;
             }
-
-            return false;
+            this->regs.set_zf(_a == 0);
+            this->regs.set_hf(false);
+            this->regs.set_cf(_carry);
+            this->regs.a = _a;
+        }
+        // CPL : Aレジスタを反転
+        inline void cpl(Peripherals &bus){
+            this->regs.a = ~this->regs.a;
+            this->regs.set_nf(true);
+            this->regs.set_hf(true);
+        }
+        // SCF : Cフラグを立てる
+        inline void scf(Peripherals &bus){
+            this->regs.set_nf(false);
+            this->regs.set_hf(false);
+            this->regs.set_cf(true);
+        }
+        // CCF : Cフラグを反転
+        inline void ccf(Peripherals &bus){
+            this->regs.set_nf(false);
+            this->regs.set_hf(false);
+            this->regs.set_cf(!this->regs.cf());
         }
 
         //---------------------------------------------------------------------------------------------
-        // call ：　プログラムカウンタの値をスタックにpushし、その後元のプログラムカウンタに戻す
-        // 6サイクル固定
-        inline bool call(Peripherals &bus){
-            static uint8_t _step = 0;
-            static uint16_t _val16 = 0;
-
-            RE_ACTION:
-            switch(_step){
-                case 0:
-                    // プログラムカウンタの値取り出し
-                    if(this->read16(bus, this->imm16, _val16)){
-                        _step = 1;
-                        goto RE_ACTION;
-                    }
-                    return false;
-                case 1:
-                    // プログラムカウンタの値をpush（3サイクル）
-                    if(this->push16(bus, this->regs.pc)){
-                        // 記録した値を戻す
-                        this->regs.pc = _val16;
-                        _step = 2;
-                        goto RE_ACTION;
-                    }
-                    return false;
-                case 2:
-                    _step = 0;
-                    this->fetch(bus);
-                    return true;
-            };
-
-            return false;
+        // push ：　16bitの値を、スタックポインタをデクリメントした後にスタックポインタが指すアドレスに値を格納する
+        // 4サイクル固定
+        template<Reg16 R> void push(Peripherals &bus){
+            uint16_t _val16 = this->load16<R>(bus);
+            this->internal_cycle();
+            this->push16(bus, _val16);
+        }
+        // pop : 16bitの値をスタックからpop、3サイクル
+        template<Reg16 R> void pop(Peripherals &bus){
+            this->store16<R>(bus, this->pop16(bus));
         }
 
         //---------------------------------------------------------------------------------------------
         // JP : PCに値を格納する = ジャンプする
+        // 後方へのジャンプはアイドルループの候補として記録する
         inline void jp(Peripherals &bus){
-            static uint8_t _step = 0;
-            static uint16_t _val16 = 0;
-
-            switch(_step){
-                case 0:
-                    if(this->read16(bus, this->imm16, _val16)){
-                        this->regs.pc = _val16;
-                        _step = 1;
-                        break;
-                    }
-                    break;
-                case 1:
-                    _step = 0;
-                    this->fetch(bus);
-                    break;
-            };
+            uint16_t _from = this->regs.pc - 3;
+            this->regs.pc = this->load16<Imm16{}>(bus);
+            this->internal_cycle();
+            this->loop_branch(_from);
+        }
+        template<Cond C> void jp_c(Peripherals &bus){
+            uint16_t _val16 = this->load16<Imm16{}>(bus);
+            if(this->cond<C>()){
+                uint16_t _from = this->regs.pc - 3;
+                this->regs.pc = _val16;
+                this->internal_cycle();                 // ジャンプの場合はサイクル数+1
+                this->loop_branch(_from);
+            }
+        }
+        // JP HL
+        inline void jp_hl(Peripherals &bus){
+            this->regs.pc = this->regs.hl();
         }
 
         //---------------------------------------------------------------------------------------------
         // JR : プログラムカウンタに値を加算する
         inline void jr(Peripherals &bus){
-            static uint8_t _step = 0;
-            static uint8_t _val8 = 0;
-
-            switch(_step){
-                case 0:
-                    if(this->read8(bus, this->imm8, _val8)){
-                        this->regs.pc += (int8_t)_val8;
-                        _step = 1;
-                    }
-                    break;
-                case 1:
-                    _step = 0;
-                    this->fetch(bus);
-                    break;
-            };
+            int8_t _val8 = (int8_t)this->load8<Imm8{}>(bus);
+            uint16_t _from = this->regs.pc - 2;
+            this->regs.pc += _val8;
+            this->internal_cycle();
+            this->loop_branch(_from);
         }
-
-
-        //---------------------------------------------------------------------------------------------
         // JR c : フラグがcを満たしていればJR命令（プログラムカウンタに加算）を行う
-        inline bool cond(Peripherals &bus, Cond c){
-            switch(c){
-                case Cond::NZ: return !this->regs.zf();     // not Zフラグ
-                case Cond::Z: return this->regs.zf();       // Zフラグ
-                case Cond::NC: return !this->regs.cf();     // not Cフラグ
-                case Cond::C: return this->regs.cf();       // Cフラグ
+        template<Cond C> void jr_c(Peripherals &bus){
+            int8_t _val8 = (int8_t)this->load8<Imm8{}>(bus);
+            if(this->cond<C>()){
+                uint16_t _from = this->regs.pc - 2;
+                this->regs.pc += _val8;
+                this->internal_cycle();                 // ジャンプの場合はサイクル数+1
+                this->loop_branch(_from);
             }
-            return true;
-        }
-        inline void jr_c(Peripherals &bus, Cond c){
-            static uint8_t _step = 0;
-            static uint8_t _val8 = 0;
-
-            RE_ACTION:
-            switch(_step){
-                case 0:
-                    if(this->read8(bus, this->imm8, _val8)) {
-                        if(this->cond(bus, c)){
-                            this->regs.pc += (uint16_t)((int8_t)_val8);
-                            _step = 1;                      // ジャンプの場合はサイクル数+1
-                        }
-                        else _step = 2;
-                        //goto RE_ACTION;
-                    }
-                    break;
-                case 1:
-                    _step = 2;
-                    break;
-                case 2:
-                    _step = 0;
-                    this->fetch(bus);
-                    break;
+        }
+
+        //---------------------------------------------------------------------------------------------
+        // call ：　プログラムカウンタの値をスタックにpushし、即値のアドレスにジャンプする
+        // 6サイクル固定
+        inline void call(Peripherals &bus){
+            uint16_t _val16 = this->load16<Imm16{}>(bus);
+            this->internal_cycle();
+            this->push16(bus, this->regs.pc);
+            this->regs.pc = _val16;
+        }
+        template<Cond C> void call_c(Peripherals &bus){
+            uint16_t _val16 = this->load16<Imm16{}>(bus);
+            if(this->cond<C>()){
+                this->internal_cycle();
+                this->push16(bus, this->regs.pc);
+                this->regs.pc = _val16;
             }
         }
+        // RST : 固定アドレスへのcall、4サイクル
+        template<uint8_t V> void rst(Peripherals &bus){
+            this->internal_cycle();
+            this->push16(bus, this->regs.pc);
+            this->regs.pc = V;
+        }
 
         //---------------------------------------------------------------------------------------------
         // RET : return
         // 16bitの値をプログラムカウンタに代入する、4サイクル
         inline void ret(Peripherals &bus){
-            static uint8_t _step = 0;
-            static uint16_t _val16 = 0;
-
-            switch(_step){
-                case 0:
-                    if(this->pop16(bus, _val16)){
-                        this->regs.pc = _val16;
-                        _step = 1;
-                    }
-                    break;
-                case 1:
-                    _step = 0;
-                    this->fetch(bus);
-                    break;
-            };
+            this->regs.pc = this->pop16(bus);
+            this->internal_cycle();
+        }
+        template<Cond C> void ret_c(Peripherals &bus){
+            this->internal_cycle();                     // 条件判定に1サイクル
+            if(this->cond<C>()){
+                this->ret(bus);
+            }
         }
-
-
-        //---------------------------------------------------------------------------------------------
         // RETI
-        // RETに加え割り込みレジスタを有効にする
+        // RETに加え割り込みを有効にする
         inline void reti(Peripherals &bus){
-            static uint8_t _step = 0;
-            static uint16_t _val16 = 0;
-
-            switch(_step){
-                case 0:
-                    if(this->pop16(bus, _val16)){
-                        this->regs.pc = _val16;
-                        _step = 1;
-                    }
-                    break;
-                case 1:
-                    _step = 0;
-                    this->interrupts.ime = true;
-                    this->fetch(bus);
-                    break;
-            };
+            this->ret(bus);
+            bus.interrupts.ime = true;
         }
 
         //---------------------------------------------------------------------------------------------
         // EI
-        // 割り込みレジスタを有効にする
+        // 割り込みを有効にする、有効になるのは次の命令の実行後
         inline void ei(Peripherals &bus){
-            this->fetch(bus);                   // fetchが先
-            this->interrupts.ime = true;
-        } 
+            this->ctx.ei_delay = true;
+        }
+        // DI
+        // 割り込みを無効にする
+        inline void di(Peripherals &bus){
+            bus.interrupts.ime = false;
+            this->ctx.ei_delay = false;
+        }
 
         //---------------------------------------------------------------------------------------------
-        // di
-        // 割り込みレジスタを有効にする
-        inline void di(Peripherals &bus){
-            this->interrupts.ime = true;
-            this->fetch(bus);
-        } 
+        // HALT : 割り込みが要求されるまで命令の実行を止める
+        inline void halt(Peripherals &bus){
+            this->ctx.halt = true;
+        }
+        // STOP : 2バイト命令、後続の1バイトは読み捨てる
+        // DIVをリセットし、HALTと同様に割り込みが要求されるまで止まる
+        // 実機はボタン入力で復帰するが、ジョイパッド割り込みの要求で代用する
+        inline void stop(Peripherals &bus){
+            this->load8<Imm8{}>(bus);
+            bus.write(0xFF04, 0);
+            this->ctx.halt = true;
+        }
+        // 未定義命令 : 実機ではCPUが停止するため、同じ命令に留まり続ける
+        inline void illegal(Peripherals &bus){
+            this->regs.pc -= 1;
+        }
+
+        //---------------------------------------------------------------------------------------------
+        // 0xCBの場合は16bit命令
+        // デコード時に0xCB以降のオペコードのハンドラに置き換えるため、実行されることはない
+        inline void cb_prefixed(Peripherals &bus){
+        }
 
         //---------------------------------------------------------------------------------------------
         // call_isr
-        // 割り込み処理
+        // 割り込み処理、5サイクル
+        // IFの該当bitを下げ、PCをpushして割り込みベクタにジャンプする
         inline void call_isr(Peripherals &bus){
-            static uint8_t _step = 0;
-
-            switch(_step){
-                case 0:
-                    if(this->pop16(bus, this->regs.pc)){
-                        // 割り込み処理
-                        _step = 1;
-                    }
-                    break;
-                case 1:
-                    _step = 0;
-                    this->interrupts.ime = false;
-                    this->fetch(bus);
-                    break;
-            };
+            uint8_t _irq = bus.interrupts.get_interrupts();
+            uint8_t _bit = 0;
+            while((_irq & (1 << _bit)) == 0) _bit++;        // 優先度は下位bitほど高い
+            bus.interrupts.int_flags &= ~(1 << _bit);
+            bus.interrupts.ime = false;
+            this->idle.probing = false;
+            this->internal_cycle();
+            this->internal_cycle();
+            this->push16(bus, this->regs.pc);
+            this->regs.pc = 0x0040 + (_bit << 3);
+            this->internal_cycle();
         }
 
 
+        //---------------------------------------------------------------------------------------------
+        // 8bit命令のデコード
+        // オペコードのbitフィールドから命令とオペランドをコンパイル時に決定する
+        template<uint8_t OP> inline void decode(Peripherals &bus){
+            constexpr uint8_t x = OP >> 6;
+            constexpr uint8_t y = (OP >> 3) & 7;
+            constexpr uint8_t z = OP & 7;
+            constexpr uint8_t p = y >> 1;
+            constexpr uint8_t q = y & 1;
+
+            if constexpr (x == 0) {
+                if constexpr (z == 0) {
+                    if constexpr (y == 0) this->nop(bus);
+                    else if constexpr (y == 1) this->ld_direct_sp(bus);
+                    else if constexpr (y == 2) this->stop(bus);
+                    else if constexpr (y == 3) this->jr(bus);
+                    else this->jr_c<COND_TABLE[y - 4]>(bus);
+                }
+                else if constexpr (z == 1) {
+                    if constexpr (q == 0) this->ld16<RP_TABLE[p], Imm16{}>(bus);
+                    else this->add_hl<RP_TABLE[p]>(bus);
+                }
+                else if constexpr (z == 2) {
+                    if constexpr (q == 0) this->ld<IND_TABLE[p], Reg8::A>(bus);
+                    else this->ld<Reg8::A, IND_TABLE[p]>(bus);
+                }
+                else if constexpr (z == 3) {
+                    if constexpr (q == 0) this->inc16<RP_TABLE[p]>(bus);
+                    else this->dec16<RP_TABLE[p]>(bus);
+                }
+                else if constexpr (z == 4) this->inc<R_OPERAND<y>>(bus);
+                else if constexpr (z == 5) this->dec<R_OPERAND<y>>(bus);
+                else if constexpr (z == 6) this->ld<R_OPERAND<y>, Imm8{}>(bus);
+                else {
+                    if constexpr (y < 4) this->rot_a<ROT_TABLE[y]>(bus);
+                    else if constexpr (y == 4) this->daa(bus);
+                    else if constexpr (y == 5) this->cpl(bus);
+                    else if constexpr (y == 6) this->scf(bus);
+                    else this->ccf(bus);
+                }
+            }
+            else if constexpr (x == 1) {
+                if constexpr (y == 6 && z == 6) this->halt(bus);
+                else this->ld<R_OPERAND<y>, R_OPERAND<z>>(bus);
+            }
+            else if constexpr (x == 2) {
+                this->alu_op<ALU_TABLE[y], R_OPERAND<z>>(bus);
+            }
+            else {
+                if constexpr (z == 0) {
+                    if constexpr (y < 4) this->ret_c<COND_TABLE[y]>(bus);
+                    else if constexpr (y == 4) this->ld<Direct8::DFF, Reg8::A>(bus);
+                    else if constexpr (y == 5) this->add_sp(bus);
+                    else if constexpr (y == 6) this->ld<Reg8::A, Direct8::DFF>(bus);
+                    else this->ld_hl_sp(bus);
+                }
+                else if constexpr (z == 1) {
+                    if constexpr (q == 0) this->pop<RP2_TABLE[p]>(bus);
+                    else if constexpr (p == 0) this->ret(bus);
+                    else if constexpr (p == 1) this->reti(bus);
+                    else if constexpr (p == 2) this->jp_hl(bus);
+                    else this->ld_sp_hl(bus);
+                }
+                else if constexpr (z == 2) {
+                    if constexpr (y < 4) this->jp_c<COND_TABLE[y]>(bus);
+                    else if constexpr (y == 4) this->ld<Indirect::CFF, Reg8::A>(bus);
+                    else if constexpr (y == 5) this->ld<Direct8::D, Reg8::A>(bus);
+                    else if constexpr (y == 6) this->ld<Reg8::A, Indirect::CFF>(bus);
+                    else this->ld<Reg8::A, Direct8::D>(bus);
+                }
+                else if constexpr (z == 3) {
+                    if constexpr (y == 0) this->jp(bus);
+                    else if constexpr (y == 1) this->cb_prefixed(bus);
+                    else if constexpr (y == 6) this->di(bus);
+                    else if constexpr (y == 7) this->ei(bus);
+                    else this->illegal(bus);
+                }
+                else if constexpr (z == 4) {
+                    if constexpr (y < 4) this->call_c<COND_TABLE[y]>(bus);
+                    else this->illegal(bus);
+                }
+                else if constexpr (z == 5) {
+                    if constexpr (q == 0) this->push<RP2_TABLE[p]>(bus);
+                    else if constexpr (p == 0) this->call(bus);
+                    else this->illegal(bus);
+                }
+                else if constexpr (z == 6) this->alu_op<ALU_TABLE[y], Imm8{}>(bus);
+                else this->rst<y * 8>(bus);
+            }
+        }
 
+        // 16bit命令（0xCB）のデコード
+        template<uint8_t OP> inline void decode_cb(Peripherals &bus){
+            constexpr uint8_t x = OP >> 6;
+            constexpr uint8_t y = (OP >> 3) & 7;
+            constexpr uint8_t z = OP & 7;
 
+            if constexpr (x == 0) this->rot_op<ROT_TABLE[y], R_OPERAND<z>>(bus);
+            else if constexpr (x == 1) this->chkbit<y, R_OPERAND<z>>(bus);
+            else if constexpr (x == 2) this->resbit<y, R_OPERAND<z>>(bus);
+            else this->setbit<y, R_OPERAND<z>>(bus);
+        }
 
 
+        //---------------------------------------------------------------------------------------------
+        // 命令キャッシュ
+        // 0xC000 以降のアドレスのブロック番号、エコーRAM（0xE000～0xFDFF）はWRAMと同じブロックにする
+        inline uint8_t code_block(uint16_t addr){
+            uint8_t _block = (addr - 0xC000) >> 6;
+            if(0x80 <= _block && _block < 0xF8) _block -= 0x80;
+            return _block;
+        }
+        // ブロックに書き込みがあったため、そのブロック内の命令を無効化する
+        inline void invalidate_block(uint8_t block){
+            this->code_blocks[block >> 5] &= ~(1u << (block & 31));
+            uint16_t _base = 0xC000 + (block << 6);
+            for(uint8_t alias = 0; alias < 2; alias++){
+                // 直前のブロックからはみ出した命令も対象にする
+                for(uint16_t pc = _base - 2; pc != (uint16_t)(_base + 0x40); pc++){
+                    Decoded &d = this->dcache[pc & (DECODE_CACHE_SIZE - 1)];
+                    if((uint16_t)d.tag == pc) d.tag = DECODE_INVALID;
+                }
+                if(block >= 0x78) break;
+                _base += 0x2000;                        // エコーRAM側
+            }
+        }
+        // PCが指す命令をデコードする、サイクル消費は呼び出し側で行う
+        // ROM・WRAM・HRAM上の命令のみキャッシュに格納し、それ以外とOAM DMAの転送中は dscratch を使う
+        __attribute__((noinline)) Decoded &decode_at(Peripherals &bus, uint16_t pc, uint32_t tag){
+            static constexpr std::array<OpHandler, 256> table = make_table<false>(std::make_index_sequence<256>{});
+            static constexpr std::array<OpHandler, 256> cb_table = make_table<true>(std::make_index_sequence<256>{});
+
+            uint8_t _op = bus.read(pc);
+            uint8_t _len = op_length(_op);
+            uint16_t _last = pc + _len - 1;
+            bool _cacheable = (tag >> 16) != DMA_BANK &&                        // OAM DMAの転送中（読めるのはHRAMのみ）でない
+                              ((pc ^ _last) & 0xC000) == 0 &&                   // 16KBの境界をまたがない
+                              (_last <= 0x7FFF ||                                   // ROM
+                               (0xC000 <= pc && _last <= 0xFDFF) ||                 // WRAM
+                               (0xFF80 <= pc && _last <= 0xFFFE));                  // HRAM
+            Decoded &d = _cacheable ? this->dcache[pc & (DECODE_CACHE_SIZE - 1)] : this->dscratch;
+
+            d.tag = _cacheable ? tag : DECODE_INVALID;
+            d.len = _len;
+            d.imm = 0;
+            if(_len >= 2) d.imm = bus.read(pc + 1);
+            if(_len == 3) d.imm |= bus.read(pc + 2) << 8;
+            d.cb = (_op == 0xCB);
+            d.opecode = d.cb ? (uint8_t)d.imm : _op;
+            d.handler = d.cb ? cb_table[d.opecode] : table[_op];
+
+            // RAM上の命令は書き込みで無効化するため、ブロックを記録する
+            if(_cacheable && pc >= 0xC000){
+                uint8_t _block = this->code_block(pc);
+                this->code_blocks[_block >> 5] |= 1u << (_block & 31);
+                _block = this->code_block(_last);
+                this->code_blocks[_block >> 5] |= 1u << (_block & 31);
+            }
+            return d;
+        }
 
 
-
-        
-
     public:
         // 変数
         Ctx ctx;
-        Imm8 imm8;
-        Imm16 imm16;
+        IdleLoop idle;
         Registers regs;
-        Interrupts interrupts;
-        uint32_t cycle;
+        uint64_t cycle;     // 起動からの経過Tサイクル
+        uint64_t idle_cycles;   // HALT・アイドルループの早送りで進めたTサイクル
         uint16_t dVal;
         uint8_t step;
         uint16_t val16;
@@ -800,87 +823,100 @@ class Cpu{
         // コンストラクタ
         Cpu(){
             this->cycle = 0;
+            this->mcycle_target = 0;
             this->step = 0;
             this->val16 = 0;
+            this->ctx = {};
+            this->idle = {};
+            this->idle_cycles = 0;
+            this->invalidate_cache();
+        }
+
+        // 命令キャッシュを全て無効化する
+        inline void invalidate_cache(){
+            for(uint32_t i = 0; i < DECODE_CACHE_SIZE; i++) this->dcache[i].tag = DECODE_INVALID;
+            for(uint8_t i = 0; i < 8; i++) this->code_blocks[i] = 0;
+        }
+
+        // 1命令を実行する
+        // 割り込みが要求されていれば命令の代わりに割り込み処理を行う
+        inline void execute(Peripherals &bus){
+            this->sync(bus);
+            // HALT中は割り込み要求があるまで何もしない（IMEに関係なく復帰する）
+            if(this->ctx.halt){
+                if(bus.interrupts.get_interrupts() == 0){
+                    this->internal_cycle();
+                    return;
+                }
+                this->ctx.halt = false;
+            }
+            if(bus.interrupts.ime && bus.interrupts.get_interrupts() > 0){
+                this->call_isr(bus);
+                return;
+            }
+            // EIの直後の命令はまだ割り込みを受け付けない
+            if(this->ctx.ei_delay){
+                this->ctx.ei_delay = false;
+                bus.interrupts.ime = true;
+            }
+            // キャッシュを引き、無ければデコードする
+            // バンク切り替えはタグのバンク番号が変わることで別の命令として扱われる
+            uint16_t _pc = this->regs.pc;
+            uint32_t _tag = ((uint32_t)bus.code_bank[_pc >> 14] << 16) | _pc;
+            Decoded *d = &this->dcache[_pc & (DECODE_CACHE_SIZE - 1)];
+            if(d->tag != _tag) d = &this->decode_at(bus, _pc, _tag);
+
+            // フェッチしたバイト数分のサイクルを消費する
+            this->ctx.opecode = d->opecode;
+            this->ctx.cb = d->cb;
+            this->ctx.imm = d->imm;
+            this->regs.pc = _pc + d->len;
+            this->cycle += d->len << 2;
+            d->handler(*this, bus);
+        }
+
+        // cycle が target_cycles に達するまで命令単位で実行する
+        // 1フレーム分（FRAME_CYCLES）ずつ呼び出すことを想定
+        inline void run_until(Peripherals &bus, uint64_t target_cycles){
+            while(this->cycle < target_cycles){
+                this->execute(bus);
+                if(this->ctx.halt || this->idle.detected) this->fast_forward(bus, target_cycles);
+            }
         }
 
-        // 16bit命令
-        inline void cb_decode(Peripherals &bus){
-            switch(this->ctx.opecode){
-                case 0x10: this->rl(bus, Reg8::B); break;                       // 2サイクル
-                case 0x11: this->rl(bus, Reg8::C); break;                       // 2サイクル
-                case 0x12: this->rl(bus, Reg8::D); break;
-                case 0x6C: this->chkbit(bus, 5, Reg8::H); break;                // 2サイクル
+        // 次のイベントまで何も起きない間のサイクルを、実行せずに進める（上限は target_cycles）
+        // HALT中 : 次のイベントのサイクルまで進め、イベントの割り込み要求で復帰させる
+        // アイドルループ : ループ1周単位でイベントの手前まで進め、ループ先頭から実行を再開する
+        inline void fast_forward(Peripherals &bus, uint64_t target_cycles){
+            if(this->ctx.halt){
+                if(bus.interrupts.get_interrupts() > 0) return;
+                uint64_t _stop = bus.next_event();
+                if(_stop > target_cycles) _stop = target_cycles;
+                if(_stop <= this->cycle) return;
+                uint64_t _skip = (_stop - this->cycle + 3) & ~(uint64_t)3;     // Mサイクル単位
+                this->cycle += _skip;
+                this->idle_cycles += _skip;
+                return;
             }
-        }
-        
-        // CPUのエミュレート
+            if(!this->idle.detected) return;
+            this->idle.detected = false;
+            this->idle.probing = false;
+            if(this->regs.pc != this->idle.start) return;
+            if(bus.interrupts.ime && bus.interrupts.get_interrupts() > 0) return;
+            uint64_t _stop = bus.next_event();
+            if(_stop > target_cycles) _stop = target_cycles;
+            if(_stop <= this->cycle) return;
+            uint64_t _skip = (_stop - this->cycle) / this->idle.period * this->idle.period;
+            this->cycle += _skip;
+            this->idle_cycles += _skip;
+        }
+
+        // CPUのエミュレート（Mサイクル単位）
+        // 命令単位で実行し、その命令が消費したサイクル分だけ以降の呼び出しでは何もしない
         inline void emulate_cycle(Peripherals &bus){
-            // 割り込み処理
-            if(this->ctx.int_flag){
-                this->call_isr(bus);
-
-            } else {
-                // 16bit命令
-                if (this->ctx.cb) {
-                    this->cb_decode(bus);
-                    return;
-                }
-
-                // 8bit命令
-                switch(this->ctx.opecode){
-                    
-                    case 0x00: this->nop(bus); break;
-                    case 0x1A: this->ld(bus, Reg8::A, Indirect::DE); break;         // 2サイクル
-                    case 0x3E: this->ld(bus, Reg8::A, this->imm8); break;           // 2サイクル
-                    case 0x06: this->ld(bus, Reg8::B, this->imm8); break;
-                    case 0x0E: this->ld(bus, Reg8::C, this->imm8); break;           // 2サイクル
-                    case 0x2E: this->ld(bus, Reg8::L, this->imm8); break;
-                    
-                    case 0x78: this->ld(bus, Reg8::A, Reg8::B); break;
-                    case 0x79: this->ld(bus, Reg8::A, Reg8::C); break;              // 1サイクル
-                    case 0x7A: this->ld(bus, Reg8::A, Reg8::D); break;
-                    case 0x7B: this->ld(bus, Reg8::A, Reg8::E); break;
-                    case 0x7C: this->ld(bus, Reg8::A, Reg8::H); break;
-                    case 0x7D: this->ld(bus, Reg8::A, Reg8::L); break;
-                    
-                    case 0x47: this->ld(bus, Reg8::B, Reg8::A); break;              // 1サイクル
-
-                    case 0x57: this->ld(bus, Reg8::D, Reg8::A); break;
-                    case 0x12: this->ld(bus, Indirect::DE, Reg8::A); break;
-                    case 0x22: this->ld(bus, Indirect::HLI, Reg8::A); break;        // 2サイクル
-                    case 0x2A: this->ld(bus, Reg8::A, Indirect::HLI); break;
-                    case 0x32: this->ld(bus, Indirect::HLD, Reg8::A); break;
-                    case 0xEA: this->ld(bus, Direct8::D, Reg8::A); break;
-                    case 0xE0: this->ld(bus, Direct8::DFF, Reg8::A); break;         // 2サイクル
-                    
-                    case 0x01: this->ld16(bus, Reg16::BC, this->imm16); break;
-                    case 0x11: this->ld16(bus, Reg16::DE, this->imm16); break;
-                    case 0x21: this->ld16(bus, Reg16::HL, this->imm16); break;      // 3サイクル
-                    case 0x31: this->ld16(bus, Reg16::SP, this->imm16); break;      // 3サイクル
-                    case 0x3D: this->dec(bus, Reg8::A); break;                      // 1サイクル
-                    case 0x05: this->dec(bus, Reg8::B); break;
-                    case 0x0D: this->dec(bus, Reg8::C); break;
-                    case 0x15: this->dec(bus, Reg8::D); break;
-                    case 0x1C: this->inc(bus, Reg8::E); break;
-                    case 0x14: this->inc(bus, Reg8::D); break;
-                    case 0x23: this->inc16(bus, Reg16::HL); break;
-                    case 0x13: this->inc16(bus, Reg16::DE); break;
-                    case 0xF5: this->push(bus, Reg16::AF); break;                   // 4サイクル
-                    case 0xC5: this->push(bus, Reg16::BC); break;
-                    case 0xE5: this->push(bus, Reg16::HL); break;
-                    case 0xF1: this->pop(bus, Reg16::AF); break;                    // 3サイクル
-                    case 0xC1: this->pop(bus, Reg16::BC); break;
-                    case 0xC3: this->jp(bus); break;
-                    case 0x18: this->jr(bus); break;
-                    case 0x28: this->jr_c(bus, Cond::Z); break;                     // 2-3サイクル
-                    case 0x20: this->jr_c(bus, Cond::NZ); break;                    // 2-3サイクル
-                    case 0xCD: this->call(bus); break;                              // 
-                    case 0xC9: this->ret(bus); break;
-                    case 0xCB: this->cb_prefixed(bus); break;
-                    case 0xFE: this->cp(bus, this->imm8); break;
-                    case 0xF3: this->di(bus); break;
-                }
+            this->mcycle_target += 4;
+            if(this->cycle < this->mcycle_target){
+                this->execute(bus);
             }
         }
 };
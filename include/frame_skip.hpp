@@ -0,0 +1,47 @@
+#ifndef FRAME_SKIP_HPP
+#define FRAME_SKIP_HPP
+
+// フレームスキップの制御
+// 1フレーム（FRAME_CYCLES）を実行する毎に実時間に対する遅れを受け取り、遅れている間は次のフレームの描画を省略する
+// 描画を省略してもPPUのタイミング・割り込みは変わらないため、重い場面ではゲーム速度ではなくフレームレートが落ちる
+#include "platform.hpp"
+
+const uint8_t FRAME_SKIP_MAX = 3;           // 連続して省略するフレーム数の既定値
+const int64_t FRAME_SKIP_LATE_US = 1000;    // 省略を始める遅れ（us）、これ以下の遅れは次のフレームの待ち時間で吸収する
+
+class FrameSkip {
+    private:
+        uint8_t run;        // 連続して省略しているフレーム数
+
+    public:
+        uint8_t max_skip;   // 連続して省略するフレーム数の上限、0の場合は省略しない
+        // 統計
+        uint32_t rendered;  // 描画したフレーム数
+        uint32_t skipped;   // 省略したフレーム数
+        int64_t late_us;    // 最後に受け取った遅れ（us）、負の場合は先行している
+
+        // コンストラクタ
+        FrameSkip(){
+            this->run = 0;
+            this->max_skip = FRAME_SKIP_MAX;
+            this->rendered = 0;
+            this->skipped = 0;
+            this->late_us = 0;
+        }
+
+        // 1フレーム分の実行後に実時間に対する遅れ（us）を受け取り、次のフレームの描画を省略するかを返す
+        // 上限まで省略した場合は遅れていても1フレーム描画し、画面が止まったままにならないようにする
+        inline bool update(int64_t late_us){
+            this->late_us = late_us;
+            if(late_us > FRAME_SKIP_LATE_US && this->run < this->max_skip){
+                this->run++;
+                this->skipped++;
+                return true;
+            }
+            this->run = 0;
+            this->rendered++;
+            return false;
+        }
+};
+
+#endif
@@ -2,9 +2,11 @@
 #ifndef INTERRUPTS
 #define INTERRUPTS
 
-// 割り込みで使用する定数
-// PPUなどは再現しないで大丈夫？
+// 割り込みで使用する定数（IF / IE のbit）
+const uint8_t VBLANK = 1 << 0;
+const uint8_t LCD_STAT = 1 << 1;
 const uint8_t TIMER = 1 << 2;
+const uint8_t SERIAL = 1 << 3;
 const uint8_t JOYPAD = 1 << 4;
 
 class Interrupts
@@ -15,6 +17,13 @@ public:
     uint8_t int_flags;
     uint8_t int_enable;
 
+    // コンストラクタ
+    Interrupts(){
+        this->ime = false;
+        this->int_flags = 0;
+        this->int_enable = 0;
+    }
+
     // 割り込み要求
     inline void irq(uint8_t val){
         this->int_flags |= val;
@@ -25,10 +34,10 @@ public:
         return this->int_flags & this->int_enable & 0b11111;
     }
 
-    // read
+    // read、IFの上位3bitは常に1
     inline uint8_t read(uint16_t addr){
         if (addr == 0xFF0F)
-            return this->int_flags;
+            return 0xE0 | this->int_flags;
         if (addr == 0xFFFF)
             return this->int_enable;
         return 0xFF;
@@ -37,7 +46,7 @@ public:
     // write
     inline void write(uint16_t addr, uint8_t val){
         if (addr == 0xFF0F)
-            this->int_flags = val;
+            this->int_flags = val & 0b11111;
         if (addr == 0xFFFF)
             this->int_enable = val;
     }
@@ -0,0 +1,32 @@
+#ifndef IO_HPP
+#define IO_HPP
+
+// I/Oレジスタ（0xFF00～0xFF7F）
+// Peripherals が128バイトのレジスタブロックとして保持し、下位7bitをインデックスにする
+#include "platform.hpp"
+
+const uint8_t IO_SIZE = 0x80;
+
+const uint8_t IO_JOYP = 0x00;   // ジョイパッド
+const uint8_t IO_SB = 0x01;     // シリアル
+const uint8_t IO_SC = 0x02;
+const uint8_t IO_DIV = 0x04;    // タイマー
+const uint8_t IO_TIMA = 0x05;
+const uint8_t IO_TMA = 0x06;
+const uint8_t IO_TAC = 0x07;
+const uint8_t IO_IF = 0x0F;     // 割り込み要求
+const uint8_t IO_LCDC = 0x40;   // PPU
+const uint8_t IO_STAT = 0x41;
+const uint8_t IO_SCY = 0x42;
+const uint8_t IO_SCX = 0x43;
+const uint8_t IO_LY = 0x44;
+const uint8_t IO_LYC = 0x45;
+const uint8_t IO_DMA = 0x46;
+const uint8_t IO_BGP = 0x47;
+const uint8_t IO_OBP0 = 0x48;
+const uint8_t IO_OBP1 = 0x49;
+const uint8_t IO_WY = 0x4A;
+const uint8_t IO_WX = 0x4B;
+const uint8_t IO_BOOT = 0x50;   // ブートROMの無効化
+
+#endif
@@ -1,110 +1,202 @@
 #ifndef MBC_HPP
 #define MBC_HPP
-#include <Arduino.h>
+#include "platform.hpp"
+#include "rom_cache.hpp"
+#include "rtc.hpp"
 
 enum class MbcType {
     NoMbc,
     Mbc1,
+    Mbc2,
+    Mbc3,
+    Mbc5,
 };
 
+// MBC2の内蔵RAM（512 × 4bit）
+const uint16_t MBC2_RAM_SIZE = 0x200;
+// MBC3のRTCレジスタ（RAMバンク番号 0x08～0x0C で選択）
+const uint8_t RTC_SELECT = 0x08;
 
+// バンク切り替え
+// バンクレジスタへの書き込みの度に 0x0000・0x4000・0xA000 に割り当てるバンクの先頭ポインタを求めておき、
+// 読み書きはポインタへの加算のみで行う
 class Mbc{
     private:
-        bool bank_mode = false;
-        uint16_t low_bank = 0x00;
-        uint16_t high_bank = 0x00;
-        uint8_t bank_size = 0;
+        RomCache *p_cache = nullptr;
+        uint8_t *p_sram = nullptr;
+        uint32_t sram_size = 0;
+        uint16_t rom_banks = 2;     // ROMのバンク数（2のべき乗）
+        // バンクレジスタ
+        bool bank_mode = false;     // MBC1 : 1の場合は 0x0000～0x3FFF とSRAMにも上位bitを反映する
+        uint16_t low_bank = 1;      // ROMバンク（MBC1は下位5bit）
+        uint8_t high_bank = 0;      // MBC1 : 上位2bit、MBC3・MBC5 : RAMバンク（MBC3は 0x08～0x0C でRTC）
+        uint8_t latch_val = 0xFF;   // MBC3 : 0x6000～0x7FFF に最後に書き込まれた値、0 → 1 でRTCをラッチする
+
+        // バンクレジスタから各領域のバンクを求め、ポインタを引き直す
+        inline void update_banks(){
+            uint16_t _mask = this->rom_banks - 1;
+            uint8_t _ram_bank = 0;
+            switch(this->mbc){
+                case MbcType::NoMbc:
+                    this->rom0_bank = 0;
+                    this->romx_bank = 1 & _mask;
+                    break;
+                case MbcType::Mbc1:
+                    this->rom0_bank = this->bank_mode ? ((this->high_bank << 5) & _mask) : 0;
+                    this->romx_bank = ((this->high_bank << 5) | this->low_bank) & _mask;
+                    _ram_bank = this->bank_mode ? this->high_bank : 0;
+                    break;
+                case MbcType::Mbc2:
+                case MbcType::Mbc3:
+                case MbcType::Mbc5:
+                    this->rom0_bank = 0;
+                    this->romx_bank = this->low_bank & _mask;
+                    _ram_bank = this->high_bank;
+                    break;
+            }
+            this->rom0 = this->p_cache->bank_ptr(this->rom0_bank);
+            this->romx = this->p_cache->bank_ptr(this->romx_bank);
+
+            // SRAMは有効な場合のみ、MBC2の内蔵RAMとMBC3のRTCは read_ram / write_ram で処理する
+            this->sram = nullptr;
+            this->sram_offset = 0;
+            bool _enable = this->sram_enable || this->mbc == MbcType::NoMbc;
+            bool _rtc = this->mbc == MbcType::Mbc3 && _ram_bank >= RTC_SELECT;
+            if(_enable && this->sram_size > 0 && this->mbc != MbcType::Mbc2 && !_rtc){
+                uint32_t _banks = (this->sram_size + 0x1FFF) >> 13;
+                this->sram_offset = (uint32_t)(_ram_bank % _banks) << 13;
+                this->sram = &this->p_sram[this->sram_offset];
+            }
+        }
+
     public:
         bool sram_enable = false;
-        MbcType mbc;
+        MbcType mbc = MbcType::NoMbc;
+        uint16_t rom0_bank = 0;             // 0x0000～0x3FFF のバンク
+        uint16_t romx_bank = 1;             // 0x4000～0x7FFF のバンク
+        const uint8_t *rom0 = nullptr;      // 0x0000～0x3FFF のバンクの先頭
+        const uint8_t *romx = nullptr;      // 0x4000～0x7FFF のバンクの先頭
+        uint8_t *sram = nullptr;            // 0xA000～0xBFFF のバンクの先頭、直接アクセスできない場合は nullptr
+        uint32_t sram_offset = 0;           // sram のSRAM先頭からの位置
+        Rtc rtc;                            // MBC3のRTC
 
         // 初期化
-        inline void setup(uint8_t cartridge_type, uint8_t bank_size){
+        inline void setup(uint8_t cartridge_type, uint16_t rom_banks, RomCache *p_cache, uint8_t *p_sram, uint32_t sram_size){
+            this->p_cache = p_cache;
+            this->p_sram = p_sram;
+            this->sram_size = sram_size;
+            this->rom_banks = rom_banks;
+            this->bank_mode = false;
+            this->low_bank = 1;         // MBC1〜MBC3は0を書き込んでも1になるため、1で初期化が必要
+            this->high_bank = 0;
+            this->latch_val = 0xFF;
+            this->sram_enable = false;
             switch (cartridge_type){
-                case 0x00:
-                case 0x08:
-                case 0x09:
-                    // NoMBC
-                    this->mbc = MbcType::NoMbc;
-                    break;
                 case 0x01:
                 case 0x02:
                 case 0x03:
-                    // MBC1
                     this->mbc = MbcType::Mbc1;
-                    this->low_bank = 0b00001;       // 下位5bitのみ書き込まれる、1で初期化が必要
-                    this->high_bank = 0b00;         // 下位2bitのみ書き込まれる
-                    this->bank_size = bank_size;
+                    break;
+                case 0x05:
+                case 0x06:
+                    this->mbc = MbcType::Mbc2;
+                    break;
+                case 0x0F:
+                case 0x10:
+                case 0x11:
+                case 0x12:
+                case 0x13:
+                    this->mbc = MbcType::Mbc3;
+                    break;
+                case 0x19:
+                case 0x1A:
+                case 0x1B:
+                case 0x1C:
+                case 0x1D:
+                case 0x1E:
+                    this->mbc = MbcType::Mbc5;
+                    break;
+                default:
+                    // NoMBC（0x00・0x08・0x09）と未対応のMBC
+                    this->mbc = MbcType::NoMbc;
                     break;
             }
+            this->update_banks();
         }
 
         // MBCへの書き込み処理
         inline void write(uint16_t addr, uint8_t val){
             switch (this->mbc){
                 case MbcType::NoMbc:
+                    return;
                 case MbcType::Mbc1:
-                    // SRAM
-                    if(0x0000 <= addr && addr <= 0x1FFF){
-                        // 下位4bitに0xAを書き込むとSRAMが有効になる
-                         if((val & 0xF) == 0xA) this->sram_enable = true;
-                    }
-                    // LOWバンクレジスタ
-                    else if(0x2000 <= addr && addr <= 0x3FFF){
-                        // 下位5bitのみ使用、ただし値が0の場合は1を書く
-                        if((val & 0b11111) == 0) this->low_bank = 0b00001;
-                        else this->low_bank = val & 0b11111;
-                    }
-                    // HIGHバンクレジスタ
-                    else if(0x4000 <= addr && addr <= 0x5FFF){
-                        // 下位2bitのみ使用
-                        this->high_bank = val & 0b11;
-                    }
+                    // SRAM : 下位4bitに0xAを書き込むと有効、それ以外は無効
+                    if(addr <= 0x1FFF) this->sram_enable = (val & 0xF) == 0xA;
+                    // LOWバンクレジスタ : 下位5bitのみ使用、ただし値が0の場合は1を書く
+                    else if(addr <= 0x3FFF) this->low_bank = (val & 0b11111) ? (val & 0b11111) : 1;
+                    // HIGHバンクレジスタ : 下位2bitのみ使用
+                    else if(addr <= 0x5FFF) this->high_bank = val & 0b11;
                     // バンクモード
-                    else if(0x6000 <= addr && addr <= 0x7FFF){
-                        if((val & 0b1) > 0) this->bank_mode = true;
+                    else this->bank_mode = (val & 0b1) > 0;
+                    break;
+                case MbcType::Mbc2:
+                    // 0x0000～0x3FFF のみ、アドレスの8bit目が0ならSRAMの有効・無効、1ならROMバンク（下位4bit、0は1）
+                    if(addr > 0x3FFF) return;
+                    if(addr & 0x100) this->low_bank = (val & 0xF) ? (val & 0xF) : 1;
+                    else this->sram_enable = (val & 0xF) == 0xA;
+                    break;
+                case MbcType::Mbc3:
+                    if(addr <= 0x1FFF) this->sram_enable = (val & 0xF) == 0xA;
+                    // ROMバンク : 下位7bit、0は1
+                    else if(addr <= 0x3FFF) this->low_bank = (val & 0x7F) ? (val & 0x7F) : 1;
+                    // RAMバンク（0x00～0x07）またはRTCレジスタ（0x08～0x0C）
+                    else if(addr <= 0x5FFF) this->high_bank = val & 0x0F;
+                    // 0x6000～0x7FFF はRTCのラッチ、0 → 1 の順に書き込むと現在の時刻をラッチする
+                    else {
+                        if(this->latch_val == 0 && val == 1) this->rtc.latch();
+                        this->latch_val = val;
+                        return;
                     }
                     break;
+                case MbcType::Mbc5:
+                    if(addr <= 0x1FFF) this->sram_enable = val == 0x0A;
+                    // ROMバンク : 0x2000～0x2FFF で下位8bit、0x3000～0x3FFF で9bit目（0も選択できる）
+                    else if(addr <= 0x2FFF) this->low_bank = (this->low_bank & 0x100) | val;
+                    else if(addr <= 0x3FFF) this->low_bank = (this->low_bank & 0xFF) | ((val & 1) << 8);
+                    // RAMバンク : 下位4bit
+                    else if(addr <= 0x5FFF) this->high_bank = val & 0x0F;
+                    else return;
+                    break;
             }
+            this->update_banks();
         }
 
-        // カートリッジ内のアドレス取得
-        inline uint16_t get_addr(uint16_t addr){
-            switch (this->mbc){
-                case MbcType::NoMbc:
-                case MbcType::Mbc1:
-                    // 読み出しのみ
-                    if(0x0000 <= addr && addr <= 0x3FFF){
-                        // バンクモードが有効か？
-                        if(this->bank_mode){
-                            return ((this->high_bank << 19) | (addr & 0x3FFF));
-                        } else {
-                            return (addr & 0x3FFF);
-                        }
-                    }
-                    // 読み出しのみ
-                    else if(0x4000 <= addr && addr <= 0x7FFF){
-                        return (this->high_bank << 19) | ((this->low_bank & (this->bank_size -1)) << 14) | (addr & 0x3FFF);
-                    }
-                    // 読み書き
-                    else if(0xA000 <= addr && addr <= 0xBFFF){
-                        // バンクモードが有効か？
-                        if(this->bank_mode){
-                            return ((this->high_bank << 13) | (addr & 0x1FFF));
-                        } else {
-                            return (addr & 0x1FFF);
-                        }
-                    }
-                    break;
+        // アドレス（0x0000～0x7FFF）に割り当てられているROMバンク番号
+        inline uint16_t rom_bank(uint16_t addr){
+            return (addr <= 0x3FFF) ? this->rom0_bank : this->romx_bank;
+        }
+
+        // sram が nullptr の場合のSRAM領域（0xA000～0xBFFF）のリード処理
+        // MBC2の内蔵RAMは上位4bitが1、MBC3のRTCはレジスタ、それ以外（無効・容量外）は 0xFF
+        inline uint8_t read_ram(uint16_t addr){
+            if(!this->sram_enable) return 0xFF;
+            if(this->mbc == MbcType::Mbc2) return 0xF0 | this->p_sram[addr & (MBC2_RAM_SIZE - 1)];
+            if(this->mbc == MbcType::Mbc3 && this->high_bank >= RTC_SELECT){
+                uint8_t _reg = this->high_bank - RTC_SELECT;
+                return (_reg < RTC_REG_NUM) ? this->rtc.read(_reg) : 0xFF;
             }
             return 0xFF;
         }
 
-
+        // sram が nullptr の場合のSRAM領域（0xA000～0xBFFF）のライト処理
+        inline void write_ram(uint16_t addr, uint8_t val){
+            if(!this->sram_enable) return;
+            if(this->mbc == MbcType::Mbc2) this->p_sram[addr & (MBC2_RAM_SIZE - 1)] = val & 0x0F;
+            else if(this->mbc == MbcType::Mbc3 && this->high_bank >= RTC_SELECT){
+                uint8_t _reg = this->high_bank - RTC_SELECT;
+                if(_reg < RTC_REG_NUM) this->rtc.write(_reg, val);
+            }
+        }
 };
 
-
-
-
-
-#endif
\ No newline at end of file
+#endif
@@ -2,60 +2,335 @@
 #define PERIPHERALS_HPP
 
 // 周辺機器管理
+#include <array>
+#include "platform.hpp"
 #include "bootrom.hpp"
 #include "hram.hpp"
 #include "wram.hpp"
 #include "ppu.hpp"
+#include "timer.hpp"
+#include "serial.hpp"
+#include "scheduler.hpp"
 #include "cartridge.hpp"
 #include "interrupts.hpp"
+#include "io.hpp"
+
+// ブートROMが有効な間の 0x0000～0x3FFF のバンク番号（命令キャッシュ用）
+const uint16_t BOOTROM_BANK = 0xFFFF;
+// OAM DMAの転送中のバンク番号（命令キャッシュ用）、この間にデコードした命令はキャッシュに格納せず、格納済みの命令も使わない
+const uint16_t DMA_BANK = 0xFFFE;
+// OAM DMAの転送にかかるTサイクル数（160バイト × 4）、この間CPUは 0xFF00～0xFFFF にのみアクセスできる
+const uint16_t OAM_DMA_CYCLES = 160 * 4;
+
+class Peripherals;
+// I/Oレジスタのハンドラ、reg はレジスタブロックのインデックス（アドレスの下位7bit）
+typedef uint8_t (*IoRead)(Peripherals &bus, uint8_t reg);
+typedef void (*IoWrite)(Peripherals &bus, uint8_t reg, uint8_t val);
 
 class Peripherals {
     private:
         BootRom bootrom;
         Cartridge *p_cart;
+        bool dma_active;            // OAM DMAの転送中
+
+        //---------------------------------------------------------------------------------------------
+        // I/Oレジスタのハンドラ
+        // 副作用の無いレジスタ（SCX・SCY・WX・WY など）はハンドラを持たず、レジスタブロックを直接読み書きする
+        static uint8_t read_unused(Peripherals &bus, uint8_t reg){ return 0xFF; }
+        static void write_unused(Peripherals &bus, uint8_t reg, uint8_t val){}
+        // JOYP : 選択bit（4・5bit目）のみ書き込め、ボタンは押されていない状態を返す
+        static uint8_t read_joyp(Peripherals &bus, uint8_t reg){ return 0xC0 | (bus.io[IO_JOYP] & 0x30) | 0x0F; }
+        static void write_joyp(Peripherals &bus, uint8_t reg, uint8_t val){ bus.io[IO_JOYP] = val & 0x30; }
+        // シリアル・タイマー
+        static uint8_t read_serial(Peripherals &bus, uint8_t reg){ return bus.serial.read(0xFF00 | reg); }
+        static void write_serial(Peripherals &bus, uint8_t reg, uint8_t val){ bus.serial.write(0xFF00 | reg, val, bus.now, bus.scheduler); }
+        static uint8_t read_timer(Peripherals &bus, uint8_t reg){ return bus.timer.read(0xFF00 | reg, bus.now); }
+        static void write_timer(Peripherals &bus, uint8_t reg, uint8_t val){ bus.timer.write(0xFF00 | reg, val, bus.now, bus.scheduler); }
+        // IF
+        static uint8_t read_if(Peripherals &bus, uint8_t reg){ return bus.interrupts.read(0xFF0F); }
+        static void write_if(Peripherals &bus, uint8_t reg, uint8_t val){ bus.interrupts.write(0xFF0F, val); }
+        // PPU : LCDC・LYC はタイミングに影響し、LYは書き込み不可
+        static void write_lcd_timing(Peripherals &bus, uint8_t reg, uint8_t val){ bus.interrupts.irq(bus.ppu.write_timing(0xFF00 | reg, val, bus.now, bus.scheduler)); }
+        static void write_stat(Peripherals &bus, uint8_t reg, uint8_t val){ bus.ppu.write_stat(val); }
+        // パレット : 表示色のテーブルを更新する
+        static void write_palette(Peripherals &bus, uint8_t reg, uint8_t val){ bus.ppu.write_palette(reg, val); }
+        // OAM DMA
+        static void write_dma(Peripherals &bus, uint8_t reg, uint8_t val){ bus.start_dma(val); }
+        // ブートROMの無効化、以降は 0x0000～0x00FF がカートリッジになる
+        static void write_boot(Peripherals &bus, uint8_t reg, uint8_t val){
+            bus.bootrom.write(0xFF50, val);
+            bus.update_map();
+        }
+
+        // 0xFF00～0xFF7F のハンドラテーブルをコンパイル時に生成する、nullptr はレジスタブロックの読み書き
+        static constexpr std::array<IoRead, IO_SIZE> make_io_read_table(){
+            std::array<IoRead, IO_SIZE> t{};
+            for(uint8_t i = 0; i < IO_SIZE; i++){
+                bool _used = i <= IO_SC || (IO_DIV <= i && i <= IO_TAC) || i == IO_IF ||
+                             (IO_LCDC <= i && i <= IO_WX) || (0x10 <= i && i <= 0x3F);     // 0x10～0x3F はサウンド（値の保持のみ）
+                if(!_used) t[i] = &Peripherals::read_unused;
+            }
+            t[IO_JOYP] = &Peripherals::read_joyp;
+            t[IO_SB] = &Peripherals::read_serial;
+            t[IO_SC] = &Peripherals::read_serial;
+            for(uint8_t i = IO_DIV; i <= IO_TAC; i++) t[i] = &Peripherals::read_timer;
+            t[IO_IF] = &Peripherals::read_if;
+            return t;
+        }
+        static constexpr std::array<IoWrite, IO_SIZE> make_io_write_table(){
+            std::array<IoWrite, IO_SIZE> t{};
+            for(uint8_t i = 0; i < IO_SIZE; i++){
+                bool _used = i <= IO_SC || (IO_DIV <= i && i <= IO_TAC) || i == IO_IF ||
+                             (IO_LCDC <= i && i <= IO_WX) || (0x10 <= i && i <= 0x3F);
+                if(!_used) t[i] = &Peripherals::write_unused;
+            }
+            t[IO_JOYP] = &Peripherals::write_joyp;
+            t[IO_SB] = &Peripherals::write_serial;
+            t[IO_SC] = &Peripherals::write_serial;
+            for(uint8_t i = IO_DIV; i <= IO_TAC; i++) t[i] = &Peripherals::write_timer;
+            t[IO_IF] = &Peripherals::write_if;
+            t[IO_LCDC] = &Peripherals::write_lcd_timing;
+            t[IO_STAT] = &Peripherals::write_stat;
+            t[IO_LY] = &Peripherals::write_unused;
+            t[IO_LYC] = &Peripherals::write_lcd_timing;
+            t[IO_BGP] = &Peripherals::write_palette;
+            t[IO_OBP0] = &Peripherals::write_palette;
+            t[IO_OBP1] = &Peripherals::write_palette;
+            t[IO_DMA] = &Peripherals::write_dma;
+            t[IO_BOOT] = &Peripherals::write_boot;
+            return t;
+        }
+
     public:
         WRam wram;
         HRam hram;
         Ppu ppu;
+        Timer timer;
+        Serial serial;
+        Scheduler scheduler;
+        Interrupts interrupts;
+        uint8_t io[IO_SIZE];        // I/Oレジスタブロック（0xFF00～0xFF7F）
+        uint64_t now;               // 現在のTサイクル、CPUがバスアクセスの度に更新する
+        uint16_t code_bank[4];      // 16KB毎の領域に割り当てられているバンク番号、命令キャッシュのタグに使用
+
+        // 256バイト毎のページテーブル
+        // 通常のメモリはホスト側のポインタを直接引き、nullptr のページは read_io / write_io で処理する
+        const uint8_t *read_map[256];
+        uint8_t *write_map[256];
 
         // 初期化
         inline void setup(Cartridge *p_cart){
             this->p_cart = p_cart;
+            this->now = 0;
+            this->dma_active = false;
+            for(uint8_t i = 0; i < IO_SIZE; i++) this->io[i] = 0xFF;
+            this->io[IO_JOYP] = 0x30;
+            this->ppu.setup(this->io);
+            this->update_map();
         }
 
-        // MMIOのリード処理
-        inline uint8_t read(Interrupts interrupts, uint16_t addr){
-            // bootrom
-            if(0x0000 <= addr && addr <= 0x00FF) {
-                if(this->bootrom.isActive()){
-                    return this->bootrom.read(addr);
-                } else {
-                    return this->p_cart->read(addr);
+        // ページテーブル全体の構築、初期化とブートROMの無効化の際に行う
+        // MBCへの書き込み・OAM DMAの開始と終了では、割り当てが変わる領域のみ以下の map_～ で引き直す
+        inline void update_map(){
+            this->map_rom0();
+            this->map_romx();
+            this->map_vram();
+            this->map_sram();
+            this->map_wram();
+            // OAM・I/O・HRAM（0xFE00～0xFFFF）
+            for(uint16_t page = 0xFE; page < 0x100; page++){
+                this->read_map[page] = nullptr;
+                this->write_map[page] = nullptr;
+            }
+            if(this->dma_active) this->block_map();
+            this->map_code_bank();
+        }
+
+        // ROMバンク0（0x0000～0x3FFF）、ブートROMが有効な間は 0x0000～0x00FF をブートROMにする
+        inline void map_rom0(){
+            for(uint16_t page = 0x00; page < 0x40; page++){
+                this->read_map[page] = this->p_cart->rom_ptr(page << 8);
+                this->write_map[page] = nullptr;                            // MBCへの書き込み
+            }
+            if(this->bootrom.isActive()) this->read_map[0x00] = this->bootrom.get_ptr();
+        }
+
+        // ROMバンク1～（0x4000～0x7FFF）
+        inline void map_romx(){
+            for(uint16_t page = 0x40; page < 0x80; page++){
+                this->read_map[page] = this->p_cart->rom_ptr(page << 8);
+                this->write_map[page] = nullptr;                            // MBCへの書き込み
+            }
+        }
+
+        // VRAM（0x8000～0x9FFF）、タイルデータ（0x8000～0x97FF）への書き込みはタイルキャッシュを無効化するため write_io で処理する
+        inline void map_vram(){
+            for(uint16_t page = 0x80; page < 0xA0; page++){
+                this->read_map[page] = this->ppu.get_vram(page << 8);
+                this->write_map[page] = (page < 0x98) ? nullptr : this->ppu.get_vram(page << 8);
+            }
+        }
+
+        // SRAM（0xA000～0xBFFF）、無効な間は read_io / write_io で処理する
+        // バッテリーバックアップ有りの場合、書き込みはセーブのために記録するため write_io で処理する
+        inline void map_sram(){
+            for(uint16_t page = 0xA0; page < 0xC0; page++){
+                this->read_map[page] = this->p_cart->sram_ptr(page << 8);
+                this->write_map[page] = this->p_cart->sram_write_ptr(page << 8);
+            }
+        }
+
+        // WRAM（0xC000～0xDFFF）とエコーRAM（0xE000～0xFDFF）
+        inline void map_wram(){
+            for(uint16_t page = 0xC0; page < 0xFE; page++){
+                this->read_map[page] = this->wram.get_ptr(page << 8);
+                this->write_map[page] = this->wram.get_ptr(page << 8);
+            }
+        }
+
+        // OAM DMAの転送中は 0xFE00 未満の全ページを read_io / write_io で処理し、アクセスを遮断する
+        inline void block_map(){
+            for(uint16_t page = 0x00; page < 0xFE; page++){
+                this->read_map[page] = nullptr;
+                this->write_map[page] = nullptr;
+            }
+        }
+
+        // OAM DMAの終了、遮断していたページを戻す（0xFE00以降は転送中も変わらない）
+        inline void unblock_map(){
+            this->map_rom0();
+            this->map_romx();
+            this->map_vram();
+            this->map_sram();
+            this->map_wram();
+            this->map_code_bank();
+        }
+
+        // 命令キャッシュのタグ、0x8000以降はキャッシュ対象のWRAM・HRAMのみのため0固定
+        inline void map_code_bank(){
+            if(this->dma_active){
+                for(uint8_t i = 0; i < 4; i++) this->code_bank[i] = DMA_BANK;
+                return;
+            }
+            this->code_bank[0] = this->bootrom.isActive() ? BOOTROM_BANK : this->p_cart->rom_bank(0x0000);
+            this->code_bank[1] = this->p_cart->rom_bank(0x4000);
+            this->code_bank[2] = 0;
+            this->code_bank[3] = 0;
+        }
+
+        // MBCへの書き込み、割り当てが変わった領域のページのみ引き直す
+        // 同じバンクの再選択・RTCのラッチ・SRAMの割り当てが変わらない有効／無効の切り替えではページテーブルに触れない
+        // （SRAMの有効・無効は割り当てるポインタ（無効な間は nullptr）に表れる）
+        inline void write_mbc(uint16_t addr, uint8_t val){
+            const uint8_t *_rom0 = this->p_cart->rom_ptr(0x0000);
+            const uint8_t *_romx = this->p_cart->rom_ptr(0x4000);
+            const uint8_t *_sram = this->p_cart->sram_ptr(0xA000);
+            uint16_t _bank0 = this->p_cart->rom_bank(0x0000);
+            uint16_t _bankx = this->p_cart->rom_bank(0x4000);
+            this->p_cart->write(addr, val);
+            bool _rom0_changed = _rom0 != this->p_cart->rom_ptr(0x0000) || _bank0 != this->p_cart->rom_bank(0x0000);
+            bool _romx_changed = _romx != this->p_cart->rom_ptr(0x4000) || _bankx != this->p_cart->rom_bank(0x4000);
+            if(_rom0_changed) this->map_rom0();
+            if(_romx_changed) this->map_romx();
+            if(_sram != this->p_cart->sram_ptr(0xA000)) this->map_sram();
+            if(_rom0_changed || _romx_changed) this->map_code_bank();
+        }
+
+        // OAM DMAの開始、page × 0x100 からの160バイトをOAMにまとめてコピーし、転送時間の間はCPUのアクセスを制限する
+        // 転送元はページテーブルのポインタから直接コピーし、ポインタが無いページ（無効なSRAMなど）のみ1バイトずつ読む
+        inline void start_dma(uint8_t page){
+            this->io[IO_DMA] = page;
+            uint8_t _src = (page >= 0xE0) ? page - 0x20 : page;    // 0xE0以降はWRAMのエコー
+            // 転送中に再度開始した場合は、転送元を引くためにページテーブルを戻す
+            if(this->dma_active){
+                this->dma_active = false;
+                this->unblock_map();
+            }
+            const uint8_t *_ptr = this->read_map[_src];
+            if(_ptr != nullptr){
+                this->ppu.write_oam_block(_ptr);
+            } else {
+                uint8_t _buf[0xA0];
+                for(uint8_t i = 0; i < sizeof(_buf); i++) _buf[i] = this->read_io((_src << 8) | i);
+                this->ppu.write_oam_block(_buf);
+            }
+            this->dma_active = true;
+            this->block_map();
+            this->map_code_bank();
+            this->scheduler.schedule(EVENT_DMA, this->now + OAM_DMA_CYCLES);
+        }
+
+        // 次にハードウェアの状態が変化するTサイクル
+        // CPUはここまで周辺機器を進めずに実行でき、アイドルループの早送りもここで止まる
+        inline uint64_t next_event(){
+            return this->scheduler.next();
+        }
+
+        // now までに発生するイベントを順に処理し、要求された割り込みを返す
+        inline uint8_t service_events(){
+            uint8_t _irq = 0;
+            Event _ev;
+            uint64_t _at;
+            while(this->scheduler.pop_due(this->now, _ev, _at)){
+                switch(_ev){
+                    case EVENT_PPU: _irq |= this->ppu.on_event(_at, this->scheduler); break;
+                    case EVENT_TIMER: _irq |= this->timer.on_event(_at, this->scheduler); break;
+                    case EVENT_SERIAL: _irq |= this->serial.on_event(_at, this->scheduler); break;
+                    case EVENT_DMA:
+                        this->dma_active = false;
+                        this->unblock_map();
+                        break;
+                    default: break;
                 }
             }
-            else if (0x0000 <= addr && addr <= 0x7FFF) return this->p_cart->read(addr);     // cart
-            else if (0xC000 <= addr && addr <= 0xFDFF) return this->wram.read(addr);        // wram
+            return _irq;
+        }
+
+        // MMIOのリード処理
+        inline uint8_t read(uint16_t addr){
+            const uint8_t *_page = this->read_map[addr >> 8];
+            if(_page != nullptr) return _page[addr & 0xFF];
+            return this->read_io(addr);
+        }
+
+        // MMIOのライト処理
+        inline void write(uint16_t addr, uint8_t val){
+            uint8_t *_page = this->write_map[addr >> 8];
+            if(_page != nullptr) _page[addr & 0xFF] = val;
+            else this->write_io(addr, val);
+        }
+
+        // ページテーブルにポインタが無いアドレスのリード処理（I/O・HRAM・IE・OAM・無効なSRAM）
+        inline uint8_t read_io(uint16_t addr){
+            static constexpr std::array<IoRead, IO_SIZE> table = make_io_read_table();
+            if (0xFF80 <= addr && addr <= 0xFFFE) return this->hram.read(addr);             // hram
+            else if (0xFF00 <= addr && addr <= 0xFF7F) {                                    // I/Oレジスタ
+                uint8_t _reg = addr & 0x7F;
+                if(table[_reg] != nullptr) return table[_reg](*this, _reg);
+                return this->io[_reg];
+            }
+            else if (0xFFFF == addr) return this->interrupts.read(addr);                    // IE
+            else if (this->dma_active) return 0xFF;                                         // OAM DMA中
             else if (0xA000 <= addr && addr <= 0xBFFF) return this->p_cart->read(addr);     // cart
-            else if (0x8000 <= addr && addr <= 0x9FFF) return this->ppu.read(addr);         // ppu
-            else if (0xFE00 <= addr && addr <= 0xFE9F) return this->ppu.read(addr);         // ppu
-            else if (0xFF40 <= addr && addr <= 0xFF4B) return this->ppu.read(addr);         // ppu
-            else if (0xFF80 <= addr && addr <= 0xFFFE) return this->hram.read(addr);        // hram
-            else if (0xFF0F == addr && addr == 0xFFFF) return interrupts.read(addr);        // interrupts
+            else if (0xFE00 <= addr && addr <= 0xFE9F) return this->ppu.read(addr);         // ppu（OAM）
             else return 0xFF;
         }
 
-        // MMIOのライト処理
-        inline void write(Interrupts interrupts, uint16_t addr, uint8_t val){
-            // bootrom
-            if(0xFF50 == addr) {
-                this->bootrom.write(addr, val);
+        // ページテーブルにポインタが無いアドレスのライト処理（MBC・I/O・HRAM・IE・タイルデータ・OAM・無効なSRAM・セーブするSRAM）
+        inline void write_io(uint16_t addr, uint8_t val){
+            static constexpr std::array<IoWrite, IO_SIZE> table = make_io_write_table();
+            if (0xFF80 <= addr && addr <= 0xFFFE) this->hram.write(addr, val);              // hram
+            else if (0xFF00 <= addr && addr <= 0xFF7F) {                                    // I/Oレジスタ
+                uint8_t _reg = addr & 0x7F;
+                if(table[_reg] != nullptr) table[_reg](*this, _reg, val);
+                else this->io[_reg] = val;
             }
-            else if (0x8000 <= addr && addr <= 0x9FFF) this->ppu.write(addr, val);          // ppu
-            else if (0xC000 <= addr && addr <= 0xFDFF) this->wram.write(addr, val);         // wram
-            else if (0xFE00 <= addr && addr <= 0xFE9F) this->ppu.write(addr, val);          // ppu
-            else if (0xFF40 <= addr && addr <= 0xFF4B) this->ppu.write(addr, val);          // ppu
-            else if (0xFF80 <= addr && addr <= 0xFFFE) this->hram.write(addr, val);         // hram
-            else if (0xFF0F == addr && addr == 0xFFFF) interrupts.write(addr, val);         // interrupts
+            else if (0xFFFF == addr) this->interrupts.write(addr, val);                     // IE
+            else if (this->dma_active) return;                                              // OAM DMA中
+            else if (0x8000 <= addr && addr <= 0x97FF) this->ppu.write(addr, val);          // ppu（タイルデータ）
+            else if (0x0000 <= addr && addr <= 0x7FFF) this->write_mbc(addr, val);         // cart（MBC）
+            else if (0xA000 <= addr && addr <= 0xBFFF) this->p_cart->write(addr, val);    // cart
+            else if (0xFE00 <= addr && addr <= 0xFE9F) this->ppu.write(addr, val);          // ppu（OAM）
         }
 
 };
@@ -0,0 +1,18 @@
+#ifndef PLATFORM_HPP
+#define PLATFORM_HPP
+
+// 実機（Arduino）とネイティブ（Linux）ビルドの差分を吸収する
+// ネイティブビルドでは Arduino.h が無いため、使用している定義だけを用意する
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#endif
+
+#endif
@@ -1,6 +1,13 @@
 #ifndef PPU_HPP
 #define PPU_HPP
 
+#include <array>
+#include "platform.hpp"
+#include "scheduler.hpp"
+#include "interrupts.hpp"
+#include "io.hpp"
+#include "spsc_ring.hpp"
+
 // LCDCレジスタで使用する定数
 const uint8_t PPU_ENABLE = 1 << 7;
 const uint8_t WINDOW_TILE_MAP = 1 << 6;
@@ -18,6 +25,86 @@ const uint8_t VBLANK_INT = 1 << 4;
 const uint8_t HBLANK_INT = 1 << 3;
 const uint8_t LYC_EQ_LY = 1 << 2;
 
+// 1フレームあたりのTサイクル数（456ドット × 154ライン）
+const uint32_t FRAME_CYCLES = 456 * 154;
+// 1ラインのモード毎のTサイクル数（モード3の長さはスプライト数などで変わるが固定とする）
+const uint16_t LINE_CYCLES = 456;
+const uint16_t OAM_SCAN_CYCLES = 80;
+const uint16_t DRAWING_CYCLES = 172;
+const uint16_t HBLANK_CYCLES = LINE_CYCLES - OAM_SCAN_CYCLES - DRAWING_CYCLES;
+const uint8_t VBLANK_LINE = 144;    // VBlankが始まるライン
+const uint8_t LINE_NUM = 154;
+
+// 画面サイズ
+const uint8_t SCREEN_WIDTH = 160;
+const uint8_t SCREEN_HEIGHT = 144;
+// 変更があったラインのbitマスクの要素数
+const uint8_t LINE_DIRTY_WORDS = (SCREEN_HEIGHT + 31) / 32;
+// 表示側（core1）に渡すライン、ly が SCREEN_HEIGHT の場合はフレームの終わり（VBlank）
+struct ScanLine {
+    uint8_t ly;
+    alignas(4) uint16_t pixels[SCREEN_WIDTH];
+};
+const uint16_t LINE_RING_SIZE = 64;     // コア間で受け渡すラインの数
+// 色番号（パレット適用後）毎の表示色（RGB565）
+const uint16_t SHADE_COLOR[4] = {0xFFFF, 0xAD55, 0x52AA, 0x0000};
+
+// タイルキャッシュ
+// VRAMの 0x8000～0x97FF にある384タイルを、1行（8ピクセル）を16bitにまとめた形でデコードしておく
+// 左端のピクセルを下位2bitに置き、右に行くほど上位のbitになる
+const uint16_t TILE_NUM = 384;
+// VRAMの1byte（7bit目が左端）を、ピクセル毎に2bit間隔で並べ直すテーブル
+constexpr std::array<uint16_t, 256> make_tile_spread(){
+    std::array<uint16_t, 256> t{};
+    for(uint16_t v = 0; v < 256; v++){
+        for(uint8_t i = 0; i < 8; i++){
+            if(v & (0x80 >> i)) t[v] |= 1 << (i << 1);
+        }
+    }
+    return t;
+}
+constexpr std::array<uint16_t, 256> TILE_SPREAD = make_tile_spread();
+// VRAMの2byte（下位bit・上位bit）から1行分のピクセルを求める
+inline uint16_t decode_tile_row(uint8_t low, uint8_t high){
+    return TILE_SPREAD[low] | (TILE_SPREAD[high] << 1);
+}
+
+// 表示側（core1）のVRAM表示用の写し、要求があった場合にフレームの終わり（VBlank）でVRAM全体をコピーして渡す
+// core0 が書き換え中のVRAM・タイルキャッシュを core1 から直接読まないために使う
+struct VramSnapshot {
+    uint8_t lcdc;
+    uint8_t vram[0x2000];
+
+    // タイルマップの特定マスに格納されたタイルのインデックス（Ppu::get_tile_idx_from_tile_map と同じ）
+    inline uint16_t get_tile_idx_from_tile_map(bool tile_map, uint8_t row, uint8_t col) const {
+        uint8_t _val = this->vram[0x1800 | (tile_map << 10) | ((row << 5) + col)];
+        if(this->lcdc & TILE_DATA_ADDRESSING_MODE) return _val;
+        return (uint16_t)((int8_t)_val + 0x100);
+    }
+
+    // 特定タイルの1行（8ピクセル）の色番号
+    inline uint16_t get_tile_row(uint16_t tile_idx, uint8_t row) const {
+        uint16_t _addr = (tile_idx << 4) | (row << 1);
+        return decode_tile_row(this->vram[_addr], this->vram[_addr | 1]);
+    }
+};
+
+// 行（8ピクセル）の左右を反転する
+inline uint16_t flip_tile_row(uint16_t pixels){
+    pixels = ((pixels >> 2) & 0x3333) | ((pixels & 0x3333) << 2);
+    pixels = ((pixels >> 4) & 0x0F0F) | ((pixels & 0x0F0F) << 4);
+    return (pixels >> 8) | (pixels << 8);
+}
+
+// スプライト（OAM）
+const uint8_t SPRITE_NUM = 40;
+const uint8_t SPRITE_PER_LINE = 10;     // 1ラインに表示できるスプライト数
+// 属性（OAMの4byte目）で使用する定数
+const uint8_t SPRITE_BG_PRIORITY = 1 << 7;  // bgの色番号1～3の後ろに表示する
+const uint8_t SPRITE_Y_FLIP = 1 << 6;
+const uint8_t SPRITE_X_FLIP = 1 << 5;
+const uint8_t SPRITE_PALETTE = 1 << 4;      // 0 : OBP0、1 : OBP1
+
 enum Mode {
     HBlank = 0,
     VBlank = 1,
@@ -27,31 +114,298 @@ enum Mode {
 
 class Ppu {
     private:
-        uint8_t width;
-        uint8_t height;
         Mode mode;
-        uint8_t lcdc;
-        uint8_t stat;
-        uint8_t scx;        // スクロール用のレジスタ
-        uint8_t scy;
-        uint8_t ly;         // 現在描画している行目、書き込み不可
-        uint8_t lyc;        // ly と lyc が一致した際に割り込みが発生
-        uint8_t bgp;        // bg / window用
-        uint8_t obp0;       // sprite用
-        uint8_t obp1;       // 
-        uint8_t wx;         // windowの左上座標
-        uint8_t wy;         //
+        // レジスタはPeripheralsのI/Oレジスタブロックに置き、直接参照する
+        // LCDC・STAT・LY・LYC は書き込みを write_timing / write_stat で処理し、それ以外は単純なメモリ
+        // SCX・SCY : スクロール、BGP : bg / window用、OBP0・OBP1 : sprite用（書き込み時に palette を更新）、WX・WY : windowの左上座標
+        uint8_t *io;
         uint8_t vram[0x2000];
         uint8_t oam[0xa0];
+        uint16_t tile_cache[TILE_NUM][8];       // デコード済みのタイル
+        uint16_t palette[3][4];                 // BGP・OBP0・OBP1 を適用した色番号毎の表示色
+        uint32_t bg_pair[16];                   // BGPの2ピクセル分（4bit）から表示色2つ（先のピクセルが下位16bit）を引くテーブル
+
+        uint32_t tile_dirty[TILE_NUM / 32];     // VRAMへの書き込みがあり、キャッシュが古いタイルのbit
+        uint64_t line_sprites[SCREEN_HEIGHT];   // ライン毎に重なるスプライト（OAMの番号のbit）、Y座標の書き込み時に更新する
+        uint16_t line_bits[SCREEN_WIDTH / 8];   // 描画中ラインのbg / windowの色番号、スプライトの優先度判定に使う
+        uint8_t window_line;                    // windowの内部ライン、windowを描画したラインだけ進む
+        bool skipping;                          // 描画を省略中のフレーム（ライン0の開始時に skip_frame を反映）
+        alignas(4) uint16_t line_buffer[SCREEN_WIDTH];  // 描画中のライン
+        uint32_t line_pending[LINE_DIRTY_WORDS];    // リングが満杯で表示側に送れなかったラインのbit
+        bool vram_request;                          // 表示側（core1）がVRAMの写しを要求している
+
+        // 描画したラインが前のフレームと異なる場合、フレームバッファに書き込み表示側に送る
+        // 送れなかったラインは、次のフレームで内容が同じでも送り直す
+        inline void commit_line(uint8_t ly){
+            uint32_t _bit = 1u << (ly & 31);
+            bool _pending = (this->line_pending[ly >> 5] & _bit) > 0;
+            if(!_pending && memcmp(this->frame[ly], this->line_buffer, sizeof(this->line_buffer)) == 0) return;
+            memcpy(this->frame[ly], this->line_buffer, sizeof(this->line_buffer));
+            ScanLine *_slot = this->lines.reserve();
+            if(_slot == nullptr){
+                this->line_pending[ly >> 5] |= _bit;
+                return;
+            }
+            _slot->ly = ly;
+            memcpy(_slot->pixels, this->line_buffer, sizeof(this->line_buffer));
+            this->lines.commit();
+            this->line_pending[ly >> 5] &= ~_bit;
+        }
+
+        // フレームの終わりを表示側に送る
+        // 送れなかったラインが有る場合は、表示側のバッファに前のフレームのラインが残っているため送らない
+        // 送らなかった（リングが満杯で送れなかった）フレームは表示されず、送り直したラインを含めて次のフレームの終わりで送る
+        inline void send_frame_end(){
+            for(uint8_t w = 0; w < LINE_DIRTY_WORDS; w++){
+                if(this->line_pending[w] != 0){
+                    this->frames_dropped++;
+                    return;
+                }
+            }
+            ScanLine *_slot = this->lines.reserve();
+            if(_slot == nullptr){
+                this->frames_dropped++;
+                return;
+            }
+            _slot->ly = SCREEN_HEIGHT;
+            this->lines.commit();
+        }
+
+        // 表示側から要求があった場合、VRAMの写しを送る
+        inline void send_vram(){
+            if(!__atomic_load_n(&this->vram_request, __ATOMIC_ACQUIRE)) return;
+            VramSnapshot *_slot = this->vram_snapshots.reserve();
+            if(_slot == nullptr) return;
+            _slot->lcdc = this->io[IO_LCDC];
+            memcpy(_slot->vram, this->vram, sizeof(this->vram));
+            this->vram_snapshots.commit();
+            __atomic_store_n(&this->vram_request, false, __ATOMIC_RELEASE);
+        }
+
+        // 書き込みがあったタイルをデコードし直す
+        // 描画はCPUと同じコアで行うため、ラインの描画前にまとめて更新する
+        inline void update_tile_cache(){
+            for(uint8_t w = 0; w < TILE_NUM / 32; w++){
+                uint32_t _bits = this->tile_dirty[w];
+                while(_bits){
+                    uint16_t _tile = (w << 5) | __builtin_ctz(_bits);
+                    _bits &= _bits - 1;
+                    const uint8_t *_src = &this->vram[_tile << 4];
+                    for(uint8_t row = 0; row < 8; row++){
+                        this->tile_cache[_tile][row] = decode_tile_row(_src[row << 1], _src[(row << 1) | 1]);
+                    }
+                }
+                this->tile_dirty[w] = 0;
+            }
+        }
+
+        // タイルマップの値からタイル番号（0～383）を求める
+        // LCDCの4bit目が0の場合は 0x9000 を基準とした符号付きの番号
+        inline uint16_t map_tile(uint8_t val){
+            if(this->io[IO_LCDC] & TILE_DATA_ADDRESSING_MODE) return val;
+            return (uint16_t)((int8_t)val + 0x100);
+        }
+
+        // 1行（8ピクセル）分の色番号をパレットのテーブルで表示色にし、32bit単位で書き込む
+        inline void expand_row(uint16_t *dst, uint16_t pixels, const uint32_t *pair){
+            uint32_t _colors[4] = {
+                pair[pixels & 0xF], pair[(pixels >> 4) & 0xF], pair[(pixels >> 8) & 0xF], pair[pixels >> 12]
+            };
+            memcpy(dst, _colors, sizeof(_colors));
+        }
+        // スプライトの高さ（8 / 16）
+        inline uint8_t sprite_height(){
+            return (this->io[IO_LCDC] & SPRITE_SIZE) ? 16 : 8;
+        }
+
+        // スプライト idx が重なるラインのbitを立てる / 消す
+        inline void mark_sprite_lines(uint8_t idx, bool on){
+            int16_t _top = (int16_t)this->oam[idx << 2] - 16;
+            int16_t _bottom = _top + this->sprite_height();
+            uint64_t _bit = 1ull << idx;
+            for(int16_t y = (_top < 0) ? 0 : _top; y < _bottom && y < SCREEN_HEIGHT; y++){
+                if(on) this->line_sprites[y] |= _bit;
+                else this->line_sprites[y] &= ~_bit;
+            }
+        }
+
+        // 全スプライトのライン毎のリストを作り直す（スプライトサイズの変更時）
+        inline void rebuild_sprite_lines(){
+            for(uint8_t y = 0; y < SCREEN_HEIGHT; y++) this->line_sprites[y] = 0;
+            for(uint8_t i = 0; i < SPRITE_NUM; i++) this->mark_sprite_lines(i, true);
+        }
+
+        // bgの1ライン分の色番号を line_bits に求める
+        // 2タイル分（16ピクセル）を32bitに並べ、スクロールの端数分ずらして画面の8ピクセルを取り出す
+        inline void render_background(uint8_t ly, uint8_t lcdc){
+            uint8_t y = ly + this->io[IO_SCY];
+            uint8_t x = this->io[IO_SCX];
+            const uint8_t *_map = &this->vram[0x1800 | ((lcdc & BG_TILE_MAP) << 7) | ((y >> 3) << 5)];
+            uint8_t _row = y & 7;
+            uint8_t _fine = (x & 7) << 1;
+            uint8_t _col = x >> 3;
+            uint32_t _pixels = this->tile_cache[this->map_tile(_map[_col])][_row];
+            for(uint8_t j = 0; j < SCREEN_WIDTH / 8; j++){
+                _col = (_col + 1) & 31;
+                _pixels |= (uint32_t)this->tile_cache[this->map_tile(_map[_col])][_row] << 16;
+                this->line_bits[j] = (uint16_t)(_pixels >> _fine);
+                _pixels >>= 16;
+            }
+        }
+
+        // windowの色番号を line_bits に重ねる
+        // windowは画面の (WX - 7, WY) から右下に向かって、タイルマップの左上から描画する
+        inline void render_window(uint8_t ly, uint8_t lcdc){
+            if((lcdc & WINDOW_ENABLE) == 0 || ly < this->io[IO_WY] || this->io[IO_WX] > 166) return;
+            int16_t _left = (int16_t)this->io[IO_WX] - 7;       // -7～159
+            uint8_t _start = (_left < 0) ? 0 : _left;
+            const uint8_t *_map = &this->vram[0x1800 | ((lcdc & WINDOW_TILE_MAP) << 4) | ((this->window_line >> 3) << 5)];
+            uint8_t _row = this->window_line & 7;
+            uint8_t _fine = ((-_left) & 7) << 1;
+            // 画面の8ピクセル単位の区切りとwindowのタイルの区切りのずれを、bgのスクロールと同様に扱う
+            uint8_t j = _start >> 3;
+            int16_t _tile = ((int16_t)(j << 3) - _left) >> 3;  // -1～0、-1は左端より外側
+            uint32_t _pixels = (_tile < 0) ? 0 : this->tile_cache[this->map_tile(_map[_tile])][_row];
+            uint16_t _mask = (uint16_t)(0xFFFF << ((_start & 7) << 1));     // 最初の区切りはwindowの左端より右だけ
+            for(; j < SCREEN_WIDTH / 8; j++){
+                _tile++;
+                _pixels |= (uint32_t)this->tile_cache[this->map_tile(_map[_tile & 31])][_row] << 16;
+                this->line_bits[j] = (this->line_bits[j] & ~_mask) | ((uint16_t)(_pixels >> _fine) & _mask);
+                _pixels >>= 16;
+                _mask = 0xFFFF;
+            }
+            this->window_line++;
+        }
+
+        // スプライトを描画する
+        // OAMの順に最大10個を選び、X座標が小さい順（同じ場合はOAMの順）に優先度が高い
+        // 優先度の高いスプライトから順に、不透明なピクセルを先に置いたスプライトがそのピクセルを確保する
+        // （確保したスプライトがbgの後ろに隠れる場合も、優先度の低いスプライトは表示されない）
+        inline void render_sprites(uint8_t ly, uint16_t *line){
+            uint64_t _candidates = this->line_sprites[ly];
+            if(_candidates == 0) return;
+            uint8_t _sel[SPRITE_PER_LINE];
+            uint8_t _num = 0;
+            while(_candidates && _num < SPRITE_PER_LINE){
+                uint8_t _idx = __builtin_ctzll(_candidates);
+                _candidates &= _candidates - 1;
+                uint8_t _x = this->oam[(_idx << 2) | 1];
+                uint8_t i = _num++;
+                for(; i > 0 && this->oam[(_sel[i - 1] << 2) | 1] > _x; i--) _sel[i] = _sel[i - 1];
+                _sel[i] = _idx;
+            }
+
+            uint8_t _height = this->sprite_height();
+            uint8_t _taken[SCREEN_WIDTH / 8] = {};      // スプライトが確保したピクセルのbit
+            for(uint8_t s = 0; s < _num; s++){
+                const uint8_t *_obj = &this->oam[_sel[s] << 2];
+                int16_t _x = (int16_t)_obj[1] - 8;
+                if(_x <= -8 || _x >= SCREEN_WIDTH) continue;
+                uint8_t _attr = _obj[3];
+                uint8_t _row = ly + 16 - _obj[0];
+                if(_attr & SPRITE_Y_FLIP) _row = _height - 1 - _row;
+                uint16_t _tile = (_height == 16) ? ((_obj[2] & 0xFE) | (_row >> 3)) : _obj[2];
+                uint16_t _pixels = this->tile_cache[_tile][_row & 7];
+                if(_attr & SPRITE_X_FLIP) _pixels = flip_tile_row(_pixels);
+                const uint16_t *_palette = this->palette[(_attr & SPRITE_PALETTE) ? 2 : 1];
+                for(uint8_t i = 0; i < 8; i++, _pixels >>= 2){
+                    int16_t c = _x + i;
+                    if((_pixels & 0b11) == 0 || c < 0 || c >= SCREEN_WIDTH) continue;
+                    uint8_t _bit = 1 << (c & 7);
+                    if(_taken[c >> 3] & _bit) continue;
+                    _taken[c >> 3] |= _bit;
+                    if((_attr & SPRITE_BG_PRIORITY) && ((this->line_bits[c >> 3] >> ((c & 7) << 1)) & 0b11)) continue;
+                    line[c] = _palette[_pixels & 0b11];
+                }
+            }
+        }
+
+        // LY と LYC の一致を確認し、一致した場合の割り込み要求を返す
+        inline uint8_t compare_lyc(){
+            if(this->io[IO_LY] == this->io[IO_LYC]) {
+                this->io[IO_STAT] |= LYC_EQ_LY;
+                if(this->io[IO_STAT] & LYC_EQ_LY_INT) return LCD_STAT;
+            } else {
+                this->io[IO_STAT] &= ~LYC_EQ_LY;
+            }
+            return 0;
+        }
+
+        // モードを変更する、STATの下位2bitにも反映する
+        inline void set_mode(Mode mode){
+            this->mode = mode;
+            this->io[IO_STAT] = (this->io[IO_STAT] & ~0b11) | mode;
+        }
+
+        // ラインの開始、ラインに応じてモード2かモード1に遷移する
+        inline uint8_t start_line(uint64_t at, Scheduler &scheduler){
+            uint8_t _irq = 0;
+            if(this->io[IO_LY] < VBLANK_LINE){
+                if(this->io[IO_LY] == 0){
+                    this->window_line = 0;
+                    this->skipping = this->skip_frame;
+                }
+                this->set_mode(Mode::OamScan);
+                scheduler.schedule(EVENT_PPU, at + OAM_SCAN_CYCLES);
+                if(this->io[IO_STAT] & QAM_SCAN_INT) _irq |= LCD_STAT;
+            } else {
+                if(this->io[IO_LY] == VBLANK_LINE){
+                    this->set_mode(Mode::VBlank);
+                    this->frame_count++;
+                    if(!this->skipping) this->send_frame_end();
+                    this->send_vram();
+                    _irq |= VBLANK;
+                    if(this->io[IO_STAT] & VBLANK_INT) _irq |= LCD_STAT;
+                }
+                scheduler.schedule(EVENT_PPU, at + LINE_CYCLES);
+            }
+            return _irq | this->compare_lyc();
+        }
 
 
     public:
         uint32_t dVal;
+        alignas(4) uint16_t frame[SCREEN_HEIGHT][SCREEN_WIDTH];     // フレームバッファ、HBlank毎に変化したラインが書き込まれる（core0のみ参照）
+        uint32_t frame_count;                           // VBlankに入る度に加算
+        bool skip_frame;                                // 次のフレームの描画を省略する（タイミング・割り込みはそのまま）
+        SpscRing<ScanLine, LINE_RING_SIZE> lines;       // 変化したラインとフレームの終わりを表示側（core1）に渡すリング
+        uint32_t frames_dropped;                        // 表示側に送れなかったフレームの終わりの数
+        SpscRing<VramSnapshot, 1> vram_snapshots;       // VRAM表示用の写しを表示側に渡すリング
         // コンストラクタ
         Ppu(){
             this->mode = Mode::HBlank;
-            this->width = 160;
-            this->height = 144;
+            this->io = nullptr;
+            this->frame_count = 0;
+            this->frames_dropped = 0;
+            this->vram_request = false;
+            for(uint8_t w = 0; w < TILE_NUM / 32; w++) this->tile_dirty[w] = 0xFFFFFFFF;
+            for(uint8_t i = 0; i < sizeof(this->oam); i++) this->oam[i] = 0;
+            for(uint8_t y = 0; y < SCREEN_HEIGHT; y++) this->line_sprites[y] = 0;
+            this->window_line = 0;
+            this->skipping = false;
+            this->skip_frame = false;
+            for(uint8_t r = 0; r < SCREEN_HEIGHT; r++) memset(this->frame[r], 0, sizeof(this->frame[r]));
+            // 最初のフレームは全ラインを送る（画面外のbitは立てない）
+            for(uint8_t w = 0; w < LINE_DIRTY_WORDS; w++) this->line_pending[w] = 0;
+            for(uint8_t y = 0; y < SCREEN_HEIGHT; y++) this->line_pending[y >> 5] |= 1u << (y & 31);
+        }
+
+        // 初期化、レジスタブロックを割り当てる
+        inline void setup(uint8_t *io){
+            this->io = io;
+            this->io[IO_LCDC] = 0;
+            this->io[IO_STAT] = 0x80;
+            this->io[IO_SCY] = 0;
+            this->io[IO_SCX] = 0;
+            this->io[IO_LY] = 0;
+            this->io[IO_LYC] = 0;
+            this->write_palette(IO_BGP, 0);
+            this->write_palette(IO_OBP0, 0);
+            this->write_palette(IO_OBP1, 0);
+            this->io[IO_WY] = 0;
+            this->io[IO_WX] = 0;
+            this->set_mode(Mode::HBlank);
+            this->rebuild_sprite_lines();
         }
 
         // PPUデータのリード処理
@@ -67,17 +421,6 @@ class Ppu {
                 //else return this->oam[addr & 0xFF];
                 return this->oam[addr & 0xFF];
             } 
-            else if(0xFF40 == addr) return this->lcdc;
-            else if(0xFF41 == addr) return 0x80 | this->stat | this->mode;
-            else if(0xFF42 == addr) return this->scy;
-            else if(0xFF43 == addr) return this->scx;
-            else if(0xFF44 == addr) return this->ly;
-            else if(0xFF45 == addr) return this->lyc;
-            else if(0xFF47 == addr) return this->bgp;
-            else if(0xFF48 == addr) return this->obp0;
-            else if(0xFF49 == addr) return this->obp1;
-            else if(0xFF4A == addr) return this->wy;
-            else if(0xFF4B == addr) return this->wx;
 
             return 0xFF;
         }
@@ -90,34 +433,130 @@ class Ppu {
                 //    this->vram[addr & 0x1FFF] = val;
                 //}
                 this->vram[addr & 0x1FFF] = val;
+                // タイルデータ（0x8000～0x97FF）はキャッシュを無効にする
+                if(addr < 0x9800){
+                    uint16_t _tile = (addr & 0x1FFF) >> 4;
+                    this->tile_dirty[_tile >> 5] |= 1u << (_tile & 31);
+                }
             } else if(0xFE00 <= addr && addr <= 0xFE9F){
                 // モード2・3の時はOAMにアクセスできない
                 //if(this->mode != Mode::Drawing && this->mode != Mode::OamScan) {
                 //    this->oam[addr & 0xFF] = val;
                 //}
-                this->oam[addr & 0xFF] = val;
+                // Y座標が変わる場合はライン毎のスプライトのリストを更新する
+                uint8_t _offset = addr & 0xFF;
+                if((_offset & 3) == 0 && this->oam[_offset] != val){
+                    this->mark_sprite_lines(_offset >> 2, false);
+                    this->oam[_offset] = val;
+                    this->mark_sprite_lines(_offset >> 2, true);
+                } else {
+                    this->oam[_offset] = val;
+                }
             } 
-            else if(0xFF40 == addr) this->lcdc = val;
-            else if(0xFF41 == addr) this->stat = (this->stat & LYC_EQ_LY) | (val & 0xF0);
-            else if(0xFF42 == addr) this->scy = val;
-            else if(0xFF43 == addr) this->scx = val;
-            else if(0xFF44 == addr) {}
-            else if(0xFF45 == addr) this->lyc = val;
-            else if(0xFF47 == addr) this->bgp = val;
-            else if(0xFF48 == addr) this->obp0 = val;
-            else if(0xFF49 == addr) this->obp1 = val;
-            else if(0xFF4A == addr) this->wy = val;
-            else if(0xFF4B == addr) this->wx = val;
+        }
+
+        // OAM DMAによる160バイトの一括転送、Y座標が変わるスプライトだけライン毎のリストを更新する
+        inline void write_oam_block(const uint8_t *src){
+            for(uint8_t i = 0; i < SPRITE_NUM; i++){
+                if(this->oam[i << 2] == src[i << 2]) continue;
+                this->mark_sprite_lines(i, false);
+                this->oam[i << 2] = src[i << 2];
+                this->mark_sprite_lines(i, true);
+            }
+            memcpy(this->oam, src, sizeof(this->oam));
+        }
+
+        // ページテーブル用、addr（0x8000～0x9FFF）に対応するVRAMのポインタ
+        inline uint8_t *get_vram(uint16_t addr){
+            return &this->vram[addr & 0x1FFF];
+        }
+
+        // VRAM表示用の写しを要求する（core1）、次のフレームの終わりで vram_snapshots に送られる
+        inline void request_vram(){
+            __atomic_store_n(&this->vram_request, true, __ATOMIC_RELEASE);
+        }
+
+        // パレット（BGP・OBP0・OBP1）のライト処理、書き込み時に表示色のテーブルを作り直す
+        inline void write_palette(uint8_t reg, uint8_t val){
+            this->io[reg] = val;
+            uint8_t _p = reg - IO_BGP;
+            for(uint8_t i = 0; i < 4; i++) this->palette[_p][i] = SHADE_COLOR[(val >> (i << 1)) & 0b11];
+            if(_p == 0){
+                for(uint8_t i = 0; i < 16; i++){
+                    this->bg_pair[i] = this->palette[0][i & 0b11] | ((uint32_t)this->palette[0][i >> 2] << 16);
+                }
+            }
+        }
+
+        // STATのライト処理、下位3bit（一致フラグ・モード）は書き込み不可
+        inline void write_stat(uint8_t val){
+            this->io[IO_STAT] = 0x80 | (val & 0x78) | (this->io[IO_STAT] & 0x07);
+        }
+
+        // タイミングに関わるレジスタのライト処理（LCDC / LYC）
+        // LCDを有効にした時点からライン0のモード2を開始し、無効にするとLYは0に戻る
+        // 割り込み要求を返す（LCDの再開でラインが始まった場合、LYCの書き込みでLYと一致した場合）
+        inline uint8_t write_timing(uint16_t addr, uint8_t val, uint64_t now, Scheduler &scheduler){
+            uint8_t _irq = 0;
+            if(0xFF40 == addr) {
+                bool _enable = (val & PPU_ENABLE) > 0;
+                bool _enabled = (this->io[IO_LCDC] & PPU_ENABLE) > 0;
+                bool _resize = ((this->io[IO_LCDC] ^ val) & SPRITE_SIZE) > 0;
+                this->io[IO_LCDC] = val;
+                if(_resize) this->rebuild_sprite_lines();
+                if(_enable && !_enabled){
+                    this->io[IO_LY] = 0;
+                    _irq = this->start_line(now, scheduler);
+                } else if(!_enable && _enabled){
+                    this->io[IO_LY] = 0;
+                    this->set_mode(Mode::HBlank);
+                    scheduler.cancel(EVENT_PPU);
+                }
+            }
+            else if(0xFF45 == addr) {
+                // 既に一致していた場合は要求しない（STATの割り込みは不一致 → 一致の変化で発生する）
+                bool _matched = (this->io[IO_STAT] & LYC_EQ_LY) > 0;
+                this->io[IO_LYC] = val;
+                if(this->io[IO_LCDC] & PPU_ENABLE){
+                    _irq = this->compare_lyc();
+                    if(_matched) _irq = 0;
+                }
+            }
+            return _irq;
+        }
+
+        // モード遷移のイベント、割り込み要求を返す
+        // モード2（80） → モード3（172） → モード0（204） → 次のライン、ライン144～153はモード1
+        inline uint8_t on_event(uint64_t at, Scheduler &scheduler){
+            switch(this->mode){
+                case Mode::OamScan:
+                    this->set_mode(Mode::Drawing);
+                    scheduler.schedule(EVENT_PPU, at + DRAWING_CYCLES);
+                    return 0;
+                case Mode::Drawing:
+                    this->render_line();                // 描画が終わったラインを出力する
+                    this->set_mode(Mode::HBlank);
+                    scheduler.schedule(EVENT_PPU, at + HBLANK_CYCLES);
+                    return (this->io[IO_STAT] & HBLANK_INT) ? LCD_STAT : 0;
+                default:
+                    this->io[IO_LY] = (this->io[IO_LY] + 1 < LINE_NUM) ? this->io[IO_LY] + 1 : 0;
+                    return this->start_line(at, scheduler);
+            }
+        }
+
+        // 特定タイルの1行（8ピクセル）を取得する、col列目のピクセルは (col * 2) bit目から2bit
+        // キャッシュが古い場合はVRAMから直接デコードする（キャッシュの更新は描画時のみ行うため、別コアから呼び出せる）
+        inline uint16_t get_tile_row(uint16_t tile_idx, uint8_t row){
+            if(this->tile_dirty[tile_idx >> 5] & (1u << (tile_idx & 31))){
+                uint16_t tile_addr = (tile_idx << 4) | (row << 1);          // タイルは1行（8pix）あたり16bit
+                return decode_tile_row(this->vram[tile_addr], this->vram[tile_addr | 1]);
+            }
+            return this->tile_cache[tile_idx][row];
         }
 
         // 特定タイルの特定ピクセルデータを取得する
         inline uint8_t get_pixel_from_tile(uint16_t tile_idx, uint8_t row, uint8_t col){
-            uint16_t r = (uint16_t)(row * 2);                               // タイルは1行（8pix）あたり16bit
-            uint16_t c = (uint16_t)(7 - col);                               // col列目は（7-col）bit目
-            uint16_t tile_addr = tile_idx << 4;                             // タイルの開始アドレスはタイルのインデックスの16倍
-            uint8_t low = this->vram[(tile_addr | r)];                      // ピクセルの上位bit（8ピクセル分）
-            uint8_t high = this->vram[(tile_addr | (r+1))];                 // ピクセルの上位bit（8ピクセル分）
-            return (((high >> c) & 1) << 1) | ((low >> c) & 1);
+            return (this->get_tile_row(tile_idx, row) >> (col << 1)) & 0b11;
         }
 
         // タイルマップの特定マスに格納されたタイルのインデックスを取得する
@@ -125,44 +564,38 @@ class Ppu {
         inline uint16_t get_tile_idx_from_tile_map(bool tile_map, uint8_t row, uint8_t col){
             uint16_t start_addr = 0x1800 | (tile_map << 10);                // tile_mapが有効な場合は　0x1C00
             uint16_t ret = this->vram[(start_addr | ((row << 5) + col))];
-            if((this->lcdc & TILE_DATA_ADDRESSING_MODE) > 0) {               // lcdcの4bit目が0の場合はそのまま
+            if((this->io[IO_LCDC] & TILE_DATA_ADDRESSING_MODE) > 0) {               // lcdcの4bit目が0の場合はそのまま
                 return ret;
             } else {
-                return (uint16_t)((int16_t)ret + 0x100);                    // 符号付変数に変換し、0x100を加算した後に符号なしに戻す
+                return (uint16_t)((int8_t)ret + 0x100);                     // 符号付変数に変換し、0x100を加算した後に符号なしに戻す
             }
         }
 
-        // bgのレンダリング
-        inline void render_bg(uint16_t lcd_width, uint16_t lcd_height, uint16_t *pBuffer){
-            if(this->lcdc & BG_WINDOW_ENABLE == 0) return;
-
-            uint16_t color = 0;
-
-            for(uint8_t r = 0; r < this->height; r++){
-                uint8_t y = r + this->scy;
-
-                for(uint8_t c = 0; c < this->width; c++){
-                    uint8_t x = c + this->scx;
+        // 現在のライン（LY）をフレームバッファに描画する
+        // HBlankに入った時点のレジスタで描画するため、ライン毎のスクロール・パレット変更が反映される
+        // bg・windowは色番号を line_bits にまとめてから8ピクセル単位で表示色にし、スプライトはその上に重ねる
+        // 描画は line_buffer に行い、前のフレームから変わった場合のみフレームバッファに反映して表示側に送る
+        inline void render_line(){
+            if(this->skipping) return;
+            uint8_t _ly = this->io[IO_LY];
+            uint16_t *_line = this->line_buffer;
+            uint8_t _lcdc = this->io[IO_LCDC];
 
-                    // タイルインデックスを取得
-                    uint16_t tile_idx = this->get_tile_idx_from_tile_map((this->lcdc & BG_TILE_MAP) > 0, y >> 3, x >> 3);
-
-                    // 色取得
-                    uint8_t pixel = this->get_pixel_from_tile(tile_idx, y & 7, x & 7);
-                    switch (this->bgp >> (pixel << 1) & 0b11)
-                    {
-                        case 0b00: color = 0xFFFF; break;
-                        case 0b01: color = 0xAD55; break;
-                        case 0b10: color = 0x52AA; break;
-                        default: color = 0x0000; break;
-                    }
-
-                    pBuffer[(lcd_width * r) + c] = color;
-                }
+            this->update_tile_cache();
+            if(_lcdc & BG_WINDOW_ENABLE){
+                this->render_background(_ly, _lcdc);
+                this->render_window(_ly, _lcdc);
+                for(uint8_t j = 0; j < SCREEN_WIDTH / 8; j++) this->expand_row(&_line[j << 3], this->line_bits[j], this->bg_pair);
+            } else {
+                // bg・window無効の場合は白（色番号0）
+                uint32_t _white = SHADE_COLOR[0] | ((uint32_t)SHADE_COLOR[0] << 16);
+                for(uint8_t c = 0; c < SCREEN_WIDTH; c += 2) memcpy(&_line[c], &_white, sizeof(uint32_t));
+                for(uint8_t j = 0; j < SCREEN_WIDTH / 8; j++) this->line_bits[j] = 0;
             }
+            if(_lcdc & SPRITE_ENABLE) this->render_sprites(_ly, _line);
+            this->commit_line(_ly);
         }
 
-
 };
 
 #endif
\ No newline at end of file
@@ -3,6 +3,25 @@
 
 class Registers{
     private:
+        // フラグの遅延評価
+        // 演算命令は結果と入力だけを記録し、フラグは参照された時に求める
+        // 記録中は以下から各フラグが決まる（f は materialize_flags まで古いまま）
+        //   Z : 結果の下位8bitが0
+        //   N : flag_n
+        //   H : (入力同士のXOR ^ 結果) の4bit目、3bit目からの繰り上がり（下がり）
+        //   C : 結果の8bit目（INC/DECなどCが変化しない演算は元のCを入れておく）
+        bool flags_lazy;
+        bool flag_n;
+        uint8_t flag_hsrc;      // 入力同士のXOR
+        uint16_t flag_result;   // 演算結果、8bit目がCフラグ
+
+        inline void record_flags(uint16_t result, uint8_t hsrc, bool n){
+            this->flag_result = result;
+            this->flag_hsrc = hsrc;
+            this->flag_n = n;
+            this->flags_lazy = true;
+        }
+
     public:
         Registers(){
             this->a = 0;
@@ -15,13 +34,17 @@ class Registers{
             this->l = 0;
             this->pc = 0;
             this->sp = 0;
+            this->flags_lazy = false;
+            this->flag_n = false;
+            this->flag_hsrc = 0;
+            this->flag_result = 0;
         }
         uint8_t a;
         uint8_t b;
         uint8_t c;
         uint8_t d;
         uint8_t e;
-        uint8_t f;
+        uint8_t f;          // 遅延評価中は古い値のため af() 経由で参照する
         uint8_t h;
         uint8_t l;
         uint16_t pc;
@@ -29,6 +52,7 @@ class Registers{
 
         // AFの組み合わせのレジスタ、Fが下位ビット
         uint16_t af(){
+            this->materialize_flags();
             return uint16_t(this->a << 8 | (uint16_t)this->f);
         }
 
@@ -51,6 +75,7 @@ class Registers{
         inline void write_af(uint16_t val){
             this->a = (uint8_t)(val >> 8);
             this->f = val & 0xF0;   // Fの下位4bitは未使用で常に0らしい
+            this->flags_lazy = false;
         }
 
         // BCへの書き込み
@@ -71,26 +96,79 @@ class Registers{
             this->l = (uint8_t)val;
         }
         
+        // 現在のFの値、遅延しているフラグも含めて求めるがレジスタは書き換えない
+        // 別のコア（デバッグ表示など）から参照する場合はこちらを使う
+        inline uint8_t flags() const {
+            if(!this->flags_lazy) return this->f;
+            return ((uint8_t)this->flag_result == 0) << 7 |
+                   this->flag_n << 6 |
+                   ((this->flag_hsrc ^ this->flag_result) & 0x10) << 1 |
+                   ((this->flag_result >> 8) & 1) << 4;
+        }
+
+        // 遅延しているフラグを f に書き出す
+        inline void materialize_flags(){
+            if(!this->flags_lazy) return;
+            this->f = this->flags();
+            this->flags_lazy = false;
+        }
+
         // F（フラグレジスタ）を取得する
         // Z（7bit目） 演算結果が0の場合に1になる
         inline bool zf(){
+            if(this->flags_lazy) return (uint8_t)this->flag_result == 0;
             return (this->f & 0b1000'0000) > 0;
         }
         // N（6bit目） 減算命令の場合に1になる
         inline bool nf(){
+            if(this->flags_lazy) return this->flag_n;
             return (this->f & 0b0100'0000) > 0;
         }
         // H（5bit目） 3bit目で繰り上がり、繰り下がりが発生すると1になる
         inline bool hf(){
+            if(this->flags_lazy) return ((this->flag_hsrc ^ this->flag_result) & 0x10) > 0;
             return (this->f & 0b0010'0000) > 0;
         }
         // C（4bit目） 7bit目で繰り上がり（下がり）が発生すると1になる
         inline bool cf(){
+            if(this->flags_lazy) return (this->flag_result & 0x100) > 0;
             return (this->f & 0b0001'0000) > 0;
         }
+
+        // 演算結果からフラグを記録する（遅延評価）
+        // 8bit加算 : result は繰り上がりを含む9bitの値
+        inline void flags_add(uint8_t lhs, uint8_t rhs, uint16_t result){
+            this->record_flags(result, lhs ^ rhs, false);
+        }
+        // 8bit減算 : result は繰り下がりで負になった場合に8bit目が立つ
+        inline void flags_sub(uint8_t lhs, uint8_t rhs, uint16_t result){
+            this->record_flags(result, lhs ^ rhs, true);
+        }
+        // INC / DEC : Cフラグは変化しない
+        inline void flags_inc(uint8_t val, uint8_t result){
+            this->record_flags(result | (uint16_t)this->cf() << 8, val ^ 1, false);
+        }
+        inline void flags_dec(uint8_t val, uint8_t result){
+            this->record_flags(result | (uint16_t)this->cf() << 8, val ^ 1, true);
+        }
+        // AND / OR / XOR : Nは0、HはANDのみ1、Cは0
+        inline void flags_logic(uint8_t result, bool h){
+            this->record_flags(result, result ^ (h << 4), false);
+        }
+        // シフト・回転 : N・Hは0、Cは押し出されたbit
+        inline void flags_rot(uint8_t result, bool carry){
+            this->record_flags(result | (uint16_t)carry << 8, result, false);
+        }
+        // BIT : Zは指定bitの反転、Nは0、Hは1、Cは変化しない
+        inline void flags_bit(uint8_t masked){
+            this->record_flags(masked | (uint16_t)this->cf() << 8, masked ^ 0x10, false);
+        }
+
         // F（フラグレジスタ）をセットする
+        // 遅延中のフラグがあれば先に書き出してから変更する
         // Z（7bit目） 演算結果が0の場合に1になる
         inline void set_zf(bool flag){
+            this->materialize_flags();
             if(flag){
                 this->f |= 0b1000'0000;     // 7bit目を立てる
             } else {
@@ -99,6 +177,7 @@ class Registers{
         }
         // N（6bit目） 減算命令の場合に1になる
         inline void set_nf(bool flag){
+            this->materialize_flags();
             if(flag){
                 this->f |= 0b0100'0000;     // 6bit目を立てる
             } else {
@@ -107,6 +186,7 @@ class Registers{
         }
         // H（5bit目） 3bit目で繰り上がり、繰り下がりが発生すると1になる
         inline void set_hf(bool flag){
+            this->materialize_flags();
             if(flag){
                 this->f |= 0b0010'0000;     // 5bit目を立てる
             } else {
@@ -115,6 +195,7 @@ class Registers{
         }
         // C（4bit目） 7bit目で繰り上がり（下がり）が発生すると1になる
         inline void set_cf(bool flag){
+            this->materialize_flags();
             if(flag){
                 this->f |= 0b0001'0000;     // 4bit目を立てる
             } else {
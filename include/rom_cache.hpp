@@ -0,0 +1,114 @@
+#ifndef ROM_CACHE_HPP
+#define ROM_CACHE_HPP
+
+// ROMのバンク単位のキャッシュ
+// カートリッジのROMをファイルなどから16KBのバンク単位でまとめて読み込み、最近使われていないバンクから置き換える
+// バンク0は常に保持し、バンクのポインタはMBCのバンク切り替えの際にだけ引く（1byte毎には参照しない）
+// ROM全体がメモリ上にある場合（フラッシュのXIP領域・mmapしたファイルなど）はコピーせず、ROMのポインタをそのまま返す
+#include "platform.hpp"
+
+const uint32_t ROM_BANK_SIZE = 0x4000;
+const uint16_t ROM_BANK_MAX = 512;          // MBC5の最大バンク数
+const uint8_t ROM_CACHE_SLOTS = 8;          // 既定の保持バンク数（128KB）
+const uint8_t ROM_CACHE_MIN_SLOTS = 3;      // バンク0と、0x0000・0x4000 の両方に切り替えたバンクを同時に置ける数
+const uint8_t NO_SLOT = 0xFF;
+
+// ROMの読み出し関数、offset から size バイトを dst に読み込み、読めなかった場合は false を返す
+typedef bool (*RomReader)(void *ctx, uint32_t offset, uint8_t *dst, uint32_t size);
+
+class RomCache {
+    private:
+        const uint8_t *p_rom = nullptr;     // ROM全体がメモリ上にある場合のポインタ
+        uint8_t *padded = nullptr;          // バンク単位に満たないROMをコピーしたもの
+        uint16_t rom_banks = 0;             // p_rom のバンク数、範囲外のバンクは折り返す
+        RomReader reader = nullptr;
+        void *reader_ctx = nullptr;
+        uint8_t slot_num = 0;
+        uint8_t *slots = nullptr;           // slot_num × 16KB、スロット0はバンク0専用
+        uint16_t slot_bank[NO_SLOT];        // スロット毎に保持しているバンク
+        uint32_t slot_used[NO_SLOT];        // スロット毎の最後に使われた時刻
+        uint8_t bank_slot[ROM_BANK_MAX];    // バンク毎のスロット、保持していない場合は NO_SLOT
+        uint32_t tick = 0;
+
+        // バンクを最も使われていないスロット（スロット0以外）に読み込む
+        inline uint8_t load(uint16_t bank){
+            uint8_t _slot = 1;
+            for(uint8_t s = 2; s < this->slot_num; s++){
+                if(this->slot_used[s] < this->slot_used[_slot]) _slot = s;
+            }
+            this->fill(_slot, bank);
+            return _slot;
+        }
+
+        // スロットにバンクを読み込む、読めなかった部分は 0xFF
+        inline void fill(uint8_t slot, uint16_t bank){
+            if(this->slot_bank[slot] < ROM_BANK_MAX) this->bank_slot[this->slot_bank[slot]] = NO_SLOT;
+            uint8_t *_dst = &this->slots[(uint32_t)slot * ROM_BANK_SIZE];
+            if(!this->reader(this->reader_ctx, (uint32_t)bank * ROM_BANK_SIZE, _dst, ROM_BANK_SIZE)){
+                memset(_dst, 0xFF, ROM_BANK_SIZE);
+            }
+            this->slot_bank[slot] = bank;
+            this->bank_slot[bank] = slot;
+            this->loads++;
+        }
+
+    public:
+        // 統計
+        uint32_t hits = 0;      // 保持していたバンクを返した回数
+        uint32_t loads = 0;     // バンクを読み込んだ回数
+
+        // デストラクタ
+        ~RomCache(){
+            delete[] this->padded;
+            delete[] this->slots;
+        }
+
+        // ROM全体がメモリ上にある場合、読み出し専用のまま参照する
+        // 32KB（2バンク）未満・バンク単位でない大きさの場合は、バンクの範囲がROMの外に出ないよう 0xFF で埋めたコピーを参照する
+        inline void open_memory(const uint8_t *pRom, uint32_t size){
+            delete[] this->padded;
+            this->padded = nullptr;
+            this->p_rom = pRom;
+            this->rom_banks = size / ROM_BANK_SIZE;
+            if(size < ROM_BANK_SIZE * 2 || size % ROM_BANK_SIZE != 0){
+                this->rom_banks = (size < ROM_BANK_SIZE * 2) ? 2 : (size + ROM_BANK_SIZE - 1) / ROM_BANK_SIZE;
+                this->padded = new uint8_t[(uint32_t)this->rom_banks * ROM_BANK_SIZE];
+                memset(this->padded, 0xFF, (uint32_t)this->rom_banks * ROM_BANK_SIZE);
+                memcpy(this->padded, pRom, size);
+                this->p_rom = this->padded;
+            }
+        }
+
+        // reader からバンク単位で読み込む場合、slot_num バンク分のメモリを確保してバンク0を読み込む
+        inline void open(RomReader reader, void *ctx, uint8_t slot_num = ROM_CACHE_SLOTS){
+            this->p_rom = nullptr;
+            this->reader = reader;
+            this->reader_ctx = ctx;
+            if(slot_num < ROM_CACHE_MIN_SLOTS) slot_num = ROM_CACHE_MIN_SLOTS;
+            if(slot_num == NO_SLOT) slot_num = NO_SLOT - 1;
+            delete[] this->slots;
+            this->slot_num = slot_num;
+            this->slots = new uint8_t[(uint32_t)slot_num * ROM_BANK_SIZE];
+            for(uint8_t s = 0; s < slot_num; s++){
+                this->slot_bank[s] = ROM_BANK_MAX;
+                this->slot_used[s] = 0;
+            }
+            for(uint16_t b = 0; b < ROM_BANK_MAX; b++) this->bank_slot[b] = NO_SLOT;
+            this->tick = 0;
+            this->fill(0, 0);
+        }
+
+        // バンクの先頭のポインタ、保持していない場合は読み込む
+        // 読み込みで置き換えられたバンクのポインタは無効になるため、MBCのバンク切り替えの度に引き直す
+        inline const uint8_t *bank_ptr(uint16_t bank){
+            if(this->p_rom != nullptr) return &this->p_rom[(uint32_t)(bank % this->rom_banks) * ROM_BANK_SIZE];
+            bank &= ROM_BANK_MAX - 1;
+            uint8_t _slot = this->bank_slot[bank];
+            if(_slot == NO_SLOT) _slot = this->load(bank);
+            else this->hits++;
+            this->slot_used[_slot] = ++this->tick;
+            return &this->slots[(uint32_t)_slot * ROM_BANK_SIZE];
+        }
+};
+
+#endif
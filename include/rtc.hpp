@@ -0,0 +1,162 @@
+#ifndef RTC_HPP
+#define RTC_HPP
+
+// MBC3のリアルタイムクロック
+// カウンタを1秒毎に進めるのではなく、カウンタが0だった時刻（base）を保持し、ラッチ・書き込みの際にだけ現在時刻との差から求める
+// ゲームが読むのはラッチした値のため、ラッチするまで時刻の計算は行わない
+// 時刻の取得元が電源を切っている間も進む時計（wall_clock）でない場合は、セーブファイルに保存した時刻から続けて進め、
+// 電源を切っていた間は進まない
+#include "platform.hpp"
+
+const uint8_t RTC_REG_NUM = 5;
+const uint8_t RTC_S = 0;            // 秒（0～59）
+const uint8_t RTC_M = 1;            // 分（0～59）
+const uint8_t RTC_H = 2;            // 時（0～23）
+const uint8_t RTC_DL = 3;           // 日の下位8bit
+const uint8_t RTC_DH = 4;           // 日の9bit目・停止・キャリー
+const uint8_t RTC_DH_DAY = 0x01;
+const uint8_t RTC_DH_HALT = 0x40;
+const uint8_t RTC_DH_CARRY = 0x80;
+const uint32_t RTC_DAY_SECONDS = 86400;
+const uint64_t RTC_COUNT_MAX = (uint64_t)512 * RTC_DAY_SECONDS;    // 日のカウンタ（9bit）が一周する秒数
+const uint8_t RTC_SAVE_SIZE = 48;   // セーブファイルの末尾に追加するデータ（BGB・VBA-Mと同じ形式）
+const uint16_t RTC_SAVE_FRAMES = 3600;  // RTCの値を保存し直す間隔（約1分）、電源を切った場合はここまで戻る
+
+// 現在時刻（秒、UNIX時間）を返す関数
+typedef uint64_t (*RtcClock)();
+
+class Rtc {
+    private:
+        RtcClock clock = nullptr;
+        bool wall_clock = true;     // clock が電源を切っている間も進むか
+        int64_t offset = 0;         // clock に加える秒数、wall_clock でない場合に保存した時刻から続けるために使う
+        int64_t base = 0;           // カウンタが0だった時刻
+        uint64_t halt_count = 0;    // 停止中のカウンタ
+        bool halt = false;
+        bool carry = false;         // 日のカウンタが一周した、0を書き込むまで保持する
+
+        inline uint64_t now(){
+            return (this->clock != nullptr) ? (uint64_t)((int64_t)this->clock() + this->offset) : 0;
+        }
+
+        // 現在のカウンタ（秒）、日のカウンタが一周した場合はキャリーを立てて折り返す
+        inline uint64_t count(){
+            if(this->halt) return this->halt_count;
+            int64_t _diff = (int64_t)this->now() - this->base;
+            uint64_t _count = (_diff > 0) ? _diff : 0;
+            if(_count >= RTC_COUNT_MAX){
+                this->carry = true;
+                this->base += (int64_t)(_count - _count % RTC_COUNT_MAX);
+                _count %= RTC_COUNT_MAX;
+            }
+            return _count;
+        }
+
+        inline void set_count(uint64_t count){
+            if(this->halt) this->halt_count = count;
+            else this->base = (int64_t)this->now() - (int64_t)count;
+        }
+
+        // カウンタをレジスタの値に分ける
+        inline void to_regs(uint64_t count, uint8_t *regs){
+            uint16_t _days = count / RTC_DAY_SECONDS;
+            uint32_t _sec = count % RTC_DAY_SECONDS;
+            regs[RTC_S] = _sec % 60;
+            regs[RTC_M] = (_sec / 60) % 60;
+            regs[RTC_H] = _sec / 3600;
+            regs[RTC_DL] = _days & 0xFF;
+            regs[RTC_DH] = ((_days >> 8) & RTC_DH_DAY) | (this->halt ? RTC_DH_HALT : 0) | (this->carry ? RTC_DH_CARRY : 0);
+        }
+
+        // レジスタの値からカウンタを求める（範囲外の値もそのまま秒数として扱う）
+        inline uint64_t from_regs(const uint8_t *regs){
+            uint16_t _days = regs[RTC_DL] | ((regs[RTC_DH] & RTC_DH_DAY) << 8);
+            return (uint64_t)_days * RTC_DAY_SECONDS + (uint32_t)regs[RTC_H] * 3600 + regs[RTC_M] * 60 + regs[RTC_S];
+        }
+
+    public:
+        uint8_t latched[RTC_REG_NUM] = {};  // ラッチした値、ゲームが読むのはこの値
+        bool changed = false;               // レジスタが書き込まれ、保存が必要
+
+        // 時刻の取得元、未設定の場合は時刻が進まない
+        inline void setup(RtcClock clock, bool wall_clock){
+            this->clock = clock;
+            this->wall_clock = wall_clock;
+            this->offset = 0;
+            this->base = this->now();
+            this->halt_count = 0;
+            this->halt = false;
+            this->carry = false;
+            memset(this->latched, 0, sizeof(this->latched));
+            this->changed = false;
+        }
+
+        // 現在のカウンタをラッチする
+        inline void latch(){
+            this->to_regs(this->count(), this->latched);
+        }
+
+        inline uint8_t read(uint8_t reg){
+            return this->latched[reg];
+        }
+
+        // レジスタへの書き込み、他のレジスタは現在の値のまま
+        inline void write(uint8_t reg, uint8_t val){
+            uint8_t _regs[RTC_REG_NUM];
+            this->to_regs(this->count(), _regs);
+            switch(reg){
+                case RTC_S: _regs[RTC_S] = val & 0x3F; break;
+                case RTC_M: _regs[RTC_M] = val & 0x3F; break;
+                case RTC_H: _regs[RTC_H] = val & 0x1F; break;
+                case RTC_DL: _regs[RTC_DL] = val; break;
+                case RTC_DH:
+                    _regs[RTC_DH] = val;
+                    // 停止中は halt_count を保持し、再開すると止めた値から進む
+                    this->halt = (val & RTC_DH_HALT) != 0;
+                    this->carry = (val & RTC_DH_CARRY) != 0;
+                    break;
+            }
+            this->set_count(this->from_regs(_regs));
+            this->latched[reg] = _regs[reg];
+            this->changed = true;
+        }
+
+        //-------------------------------------------------------------------------------------
+        // セーブファイル
+        // 現在の値・ラッチした値（各4byte）と保存した時刻（8byte）をリトルエンディアンで並べる
+
+        inline void save(uint8_t *dst){
+            uint8_t _regs[RTC_REG_NUM];
+            uint64_t _now = this->now();
+            this->to_regs(this->count(), _regs);
+            memset(dst, 0, RTC_SAVE_SIZE);
+            for(uint8_t i = 0; i < RTC_REG_NUM; i++){
+                dst[i * 4] = _regs[i];
+                dst[(RTC_REG_NUM + i) * 4] = this->latched[i];
+            }
+            for(uint8_t i = 0; i < 8; i++) dst[RTC_REG_NUM * 8 + i] = _now >> (i * 8);
+        }
+
+        // 保存した時刻からの経過時間を進める、保存した時刻が無い（0）・現在時刻より後の場合は進めない
+        // wall_clock でない場合は、保存した時刻を現在時刻として続ける
+        inline void load(const uint8_t *src){
+            uint8_t _regs[RTC_REG_NUM];
+            uint64_t _saved = 0;
+            for(uint8_t i = 0; i < RTC_REG_NUM; i++){
+                _regs[i] = src[i * 4];
+                this->latched[i] = src[(RTC_REG_NUM + i) * 4];
+            }
+            for(uint8_t i = 0; i < 8; i++) _saved |= (uint64_t)src[RTC_REG_NUM * 8 + i] << (i * 8);
+            if(!this->wall_clock && _saved != 0 && this->clock != nullptr) this->offset = (int64_t)_saved - (int64_t)this->clock();
+            uint64_t _now = this->now();
+            this->halt = (_regs[RTC_DH] & RTC_DH_HALT) != 0;
+            this->carry = (_regs[RTC_DH] & RTC_DH_CARRY) != 0;
+            uint64_t _count = this->from_regs(_regs);
+            if(!this->halt && _saved != 0 && _now > _saved) _count += _now - _saved;
+            this->set_count(_count);
+            this->count();
+            this->changed = false;
+        }
+};
+
+#endif
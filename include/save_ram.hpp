@@ -0,0 +1,168 @@
+#ifndef SAVE_RAM_HPP
+#define SAVE_RAM_HPP
+
+// バッテリーバックアップされたカートリッジのSRAM
+// SRAMへの書き込みを256バイトのページ単位で記録し、ゲームが書き込みを止めてしばらく経った時点、
+// またはMBCでSRAMを無効にした時点で、変更のあったページだけを .sav ファイルに書き込む
+// ページの内容はエミュレーション側（core0）で受け渡し用のバッファにコピーし、ファイルへの書き込みは別のコア（core1）で行う
+// フラッシュの消去・書き込みの間は core0 もXIPから読めず止まるため、1回に書き込むのはフラッシュの1セクタ分までとし、
+// 残りのページは次に書き込みが止まった時点（SAVE_IDLE_FRAMES 後）に書き込む
+// SRAMの後ろに追加のデータ（MBC3のRTC）を置く場合も、同じくページ単位で保存する
+#include "platform.hpp"
+#include "rom_cache.hpp"
+
+const uint16_t SAVE_PAGE_SIZE = 0x100;
+const uint16_t SAVE_PAGE_MAX = 0x20000 / SAVE_PAGE_SIZE;    // MBC5の最大容量（128KB）のページ数
+const uint8_t SAVE_DIRTY_WORDS = SAVE_PAGE_MAX / 32 + 1;     // 追加のデータの分、1ワード多く持つ
+const uint16_t SAVE_IDLE_FRAMES = 60;                       // 最後の書き込みから保存するまでのフレーム数（約1秒）
+const uint8_t SAVE_STAGE_PAGES = 16;                        // 1回で受け渡すページ数（フラッシュの1セクタ、4KB）
+
+// セーブファイルへの書き込み関数、src の size バイトを offset に書き込み、書き込めなかった場合は false を返す
+typedef bool (*SaveWriter)(void *ctx, uint32_t offset, const uint8_t *src, uint32_t size);
+
+class SaveRam {
+    private:
+        uint32_t dirty[SAVE_DIRTY_WORDS] = {};              // 保存していない書き込みのあったページのbit
+        uint16_t idle_frames = 0;                           // 最後の書き込みからのフレーム数
+        bool flush_request = false;                         // SRAMが無効にされ、書き込みが止まるのを待たずに保存する
+        // core0 → core1 の受け渡し用、stage_num が0の間は core0、0以外の間は core1 のみ参照する
+        uint8_t stage[SAVE_STAGE_PAGES][SAVE_PAGE_SIZE];
+        uint16_t stage_page[SAVE_STAGE_PAGES];
+        uint8_t stage_num = 0;
+
+        // ページの大きさ、最後のページは SAVE_PAGE_SIZE より小さい場合がある
+        inline uint32_t page_bytes(uint16_t page){
+            uint32_t _offset = (uint32_t)page * SAVE_PAGE_SIZE;
+            return (this->file_size() - _offset < SAVE_PAGE_SIZE) ? this->file_size() - _offset : SAVE_PAGE_SIZE;
+        }
+
+    public:
+        uint8_t *data = nullptr;    // SRAM（size）と追加のデータ（extra）
+        uint32_t size = 0;
+        uint32_t extra = 0;
+        bool battery = false;       // バッテリーバックアップ有り、無い場合は保存しない
+        // 統計（core1 が更新する）
+        uint32_t flushes = 0;       // ファイルに書き込んだ回数
+        uint32_t pages = 0;         // ファイルに書き込んだページ数
+        uint32_t errors = 0;        // 書き込めなかったページ数
+
+        SaveRam() = default;
+        // data を持つためコピーはできない
+        SaveRam(const SaveRam &) = delete;
+        SaveRam &operator=(const SaveRam &) = delete;
+
+        // デストラクタ
+        ~SaveRam(){
+            delete[] this->data;
+        }
+
+        // SRAMの確保、内容は 0xFF（追加のデータは0）で初期化する
+        inline void setup(uint32_t size, bool battery, uint32_t extra = 0){
+            delete[] this->data;
+            this->size = size;
+            this->extra = extra;
+            this->battery = battery && size + extra > 0;
+            this->data = new uint8_t[size + extra];
+            memset(this->data, 0xFF, size);
+            memset(&this->data[size], 0, extra);
+            memset(this->dirty, 0, sizeof(this->dirty));
+            this->idle_frames = 0;
+            this->flush_request = false;
+            this->stage_num = 0;
+        }
+
+        // セーブファイルの読み込み、無い・容量が足りない場合は false（読めなかった部分は初期化したまま）
+        inline bool load(RomReader reader, void *ctx){
+            if(!this->battery) return false;
+            if(this->size > 0 && !reader(ctx, 0, this->data, this->size)) return false;
+            if(this->extra > 0 && !reader(ctx, this->size, &this->data[this->size], this->extra)) return false;
+            return true;
+        }
+
+        // セーブファイル全体の大きさ
+        inline uint32_t file_size(){
+            return this->size + this->extra;
+        }
+
+        // SRAMへの書き込みの記録、offset はSRAM先頭からの位置
+        inline void mark(uint32_t offset){
+            uint16_t _page = offset / SAVE_PAGE_SIZE;
+            this->dirty[_page >> 5] |= 1u << (_page & 31);
+            this->idle_frames = 0;
+        }
+
+        // 書き込みとしては扱わず（書き込みが止まってからの時間は戻さず）、次に保存する際に含めるページを記録する
+        inline void touch(uint32_t offset){
+            uint16_t _page = offset / SAVE_PAGE_SIZE;
+            this->dirty[_page >> 5] |= 1u << (_page & 31);
+        }
+
+        // SRAMが無効にされた場合、次のフレームの終わりで保存する
+        inline void request_flush(){
+            this->flush_request = true;
+        }
+
+        // 保存していない書き込みが有るか
+        inline bool is_dirty(){
+            for(uint8_t w = 0; w < SAVE_DIRTY_WORDS; w++){
+                if(this->dirty[w] != 0) return true;
+            }
+            return false;
+        }
+
+        //-------------------------------------------------------------------------------------
+        // core0（エミュレーション側）
+
+        // 次の end_frame で受け渡すか（書き込みが止まった、またはSRAMが無効にされ、core1 が書き込み中でない）
+        inline bool due(){
+            if(!this->battery || !this->is_dirty()) return false;
+            if(!this->flush_request && this->idle_frames + 1 < SAVE_IDLE_FRAMES) return false;
+            return __atomic_load_n(&this->stage_num, __ATOMIC_ACQUIRE) == 0;
+        }
+
+        // 1フレーム毎に呼び出し、保存する時点であれば書き込みのあったページ（最大1セクタ分）を受け渡し用のバッファにコピーする
+        // 前回の受け渡しを core1 が書き込み終えていない場合は次のフレームまで待つ、受け渡した場合は true
+        inline bool end_frame(){
+            if(!this->battery) return false;
+            if(this->idle_frames < SAVE_IDLE_FRAMES) this->idle_frames++;
+            if(!this->flush_request && this->idle_frames < SAVE_IDLE_FRAMES) return false;
+            if(__atomic_load_n(&this->stage_num, __ATOMIC_ACQUIRE) != 0) return false;
+
+            uint8_t _num = 0;
+            for(uint8_t w = 0; w < SAVE_DIRTY_WORDS && _num < SAVE_STAGE_PAGES; w++){
+                while(this->dirty[w] != 0 && _num < SAVE_STAGE_PAGES){
+                    uint8_t _bit = __builtin_ctz(this->dirty[w]);
+                    uint16_t _page = (w << 5) | _bit;
+                    memcpy(this->stage[_num], &this->data[(uint32_t)_page * SAVE_PAGE_SIZE], this->page_bytes(_page));
+                    this->stage_page[_num] = _page;
+                    this->dirty[w] &= ~(1u << _bit);
+                    _num++;
+                }
+            }
+            // 次の受け渡しは、もう一度 SAVE_IDLE_FRAMES 待ってから行う
+            this->flush_request = false;
+            this->idle_frames = 0;
+            if(_num == 0) return false;
+            __atomic_store_n(&this->stage_num, _num, __ATOMIC_RELEASE);
+            return true;
+        }
+
+        //-------------------------------------------------------------------------------------
+        // core1（ファイル側）
+
+        // 受け渡されたページをファイルに書き込み、書き込んだページ数を返す
+        inline uint8_t flush(SaveWriter writer, void *ctx){
+            uint8_t _num = __atomic_load_n(&this->stage_num, __ATOMIC_ACQUIRE);
+            if(_num == 0) return 0;
+            for(uint8_t i = 0; i < _num; i++){
+                uint16_t _page = this->stage_page[i];
+                if(!writer(ctx, (uint32_t)_page * SAVE_PAGE_SIZE, this->stage[i], this->page_bytes(_page))) this->errors++;
+            }
+            this->flushes++;
+            this->pages += _num;
+            __atomic_store_n(&this->stage_num, 0, __ATOMIC_RELEASE);
+            return _num;
+        }
+};
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef SCALER_HPP
+#define SCALER_HPP
+
+// 160×144 のフレームを1.5倍（240×216）に拡大して表示用のバッファに書き込む
+// 出力の行・列毎に元の行・列を求めたテーブルを使い、変更があったラインに対応する行だけを書き込む
+// 表示側（core1）で呼び出し、PPU（core0）の描画とは並行して動く
+#include "platform.hpp"
+#include "ppu.hpp"
+
+const uint16_t SCALED_WIDTH = SCREEN_WIDTH * 3 / 2;
+const uint16_t SCALED_HEIGHT = SCREEN_HEIGHT * 3 / 2;
+
+enum ScaleMode {
+    SCALE_NEAREST = 0,  // 最近傍
+    SCALE_BLEND = 1,    // 2ピクセルの中間に当たる出力は、両方の平均にする
+};
+
+// RGB565の2色の平均（各色の最下位bitを落としてから足す）
+inline uint16_t blend_color(uint16_t a, uint16_t b){
+    return (uint16_t)((((a ^ b) & 0xF7DE) >> 1) + (a & b));
+}
+
+class Scaler {
+    private:
+        // 1.5倍のため、出力の3ピクセルが元の2ピクセルに対応する（a, a, b / a, (a+b)/2, b）
+        uint8_t col_src[SCALED_WIDTH];      // 出力の列毎の元の列
+        uint8_t col_mix[SCALED_WIDTH];      // 1 : ブレンド時に右隣の列と平均する
+        uint8_t row_src[SCALED_HEIGHT];     // 出力の行毎の元のライン
+        uint8_t row_mix[SCALED_HEIGHT];     // 1 : ブレンド時に下のラインと平均する
+        alignas(4) uint16_t row_buffer[SCREEN_WIDTH];   // 縦方向に平均したライン
+
+        inline bool is_dirty(const uint32_t *dirty, uint8_t r){
+            return (dirty[r >> 5] >> (r & 31)) & 1;
+        }
+
+        // 1ライン（160ピクセル）を横に拡大する
+        inline void scale_row(const uint16_t *src, uint16_t *dst){
+            if(this->mode == SCALE_BLEND){
+                for(uint16_t x = 0; x < SCALED_WIDTH; x++){
+                    uint8_t c = this->col_src[x];
+                    dst[x] = this->col_mix[x] ? blend_color(src[c], src[c + 1]) : src[c];
+                }
+            } else {
+                for(uint16_t x = 0; x < SCALED_WIDTH; x++) dst[x] = src[this->col_src[x]];
+            }
+        }
+
+    public:
+        ScaleMode mode;
+
+        // コンストラクタ、行・列のテーブルを作る
+        Scaler(){
+            this->mode = SCALE_NEAREST;
+            for(uint16_t x = 0; x < SCALED_WIDTH; x++){
+                this->col_src[x] = x * 2 / 3;
+                this->col_mix[x] = (x % 3) == 1;
+            }
+            for(uint16_t y = 0; y < SCALED_HEIGHT; y++){
+                this->row_src[y] = y * 2 / 3;
+                this->row_mix[y] = (y % 3) == 1;
+            }
+        }
+
+        // dirty のbitが立っているラインを拡大し、表示用のバッファ（lcd_width × lcd_height）の中央に書き込む
+        // ブレンドした行は上下2ラインのどちらかが変わった場合に書き直す、書き込んだ行数を返す
+        inline uint8_t scale(const uint16_t (*frame)[SCREEN_WIDTH], const uint32_t *dirty, uint16_t lcd_width, uint16_t lcd_height, uint16_t *pBuffer){
+            if(lcd_width < SCALED_WIDTH || lcd_height < SCALED_HEIGHT) return 0;
+            uint16_t _left = (lcd_width - SCALED_WIDTH) / 2;
+            uint16_t _top = (lcd_height - SCALED_HEIGHT) / 2;
+            uint8_t _rows = 0;
+            for(uint16_t y = 0; y < SCALED_HEIGHT; y++){
+                uint8_t r = this->row_src[y];
+                bool _mix = this->mode == SCALE_BLEND && this->row_mix[y];
+                if(!this->is_dirty(dirty, r) && !(_mix && this->is_dirty(dirty, r + 1))) continue;
+                const uint16_t *_src = frame[r];
+                if(_mix){
+                    for(uint8_t c = 0; c < SCREEN_WIDTH; c++) this->row_buffer[c] = blend_color(frame[r][c], frame[r + 1][c]);
+                    _src = this->row_buffer;
+                }
+                this->scale_row(_src, &pBuffer[lcd_width * (_top + y) + _left]);
+                _rows++;
+            }
+            return _rows;
+        }
+};
+
+#endif
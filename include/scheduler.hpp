@@ -0,0 +1,67 @@
+#ifndef SCHEDULER_HPP
+#define SCHEDULER_HPP
+
+// サイクル単位のイベントスケジューラ
+// 周辺機器は次に状態が変化するTサイクル（絶対値）を登録し、CPUはそこまで周辺機器を進めずに実行する
+// イベントは種類毎に1つまでのため、ヒープではなく種類毎の配列と最小値のキャッシュで管理する
+#include "platform.hpp"
+
+enum Event : uint8_t {
+    EVENT_PPU = 0,      // PPUのモード遷移
+    EVENT_TIMER,        // TIMAのオーバーフロー
+    EVENT_SERIAL,       // シリアル転送の完了
+    EVENT_DMA,          // OAM DMAの完了
+    EVENT_NUM,
+};
+const uint64_t NO_EVENT = UINT64_MAX;
+
+class Scheduler {
+    private:
+        uint64_t when[EVENT_NUM];   // イベント毎の発生サイクル、未登録は NO_EVENT
+        uint64_t earliest;          // when の最小値
+
+        inline void update_earliest(){
+            this->earliest = NO_EVENT;
+            for(uint8_t i = 0; i < EVENT_NUM; i++){
+                if(this->when[i] < this->earliest) this->earliest = this->when[i];
+            }
+        }
+
+    public:
+        // コンストラクタ
+        Scheduler(){
+            for(uint8_t i = 0; i < EVENT_NUM; i++) this->when[i] = NO_EVENT;
+            this->earliest = NO_EVENT;
+        }
+
+        // イベントを登録する、登録済みの場合は上書き
+        inline void schedule(Event ev, uint64_t at){
+            this->when[ev] = at;
+            this->update_earliest();
+        }
+
+        // イベントを取り消す
+        inline void cancel(Event ev){
+            this->when[ev] = NO_EVENT;
+            this->update_earliest();
+        }
+
+        // 最も早いイベントのサイクル
+        inline uint64_t next(){
+            return this->earliest;
+        }
+
+        // now までに発生するイベントを1つ取り出す
+        // at には登録されていたサイクルを返す（処理の遅れで周期がずれないよう、次の登録は at を基準にする）
+        inline bool pop_due(uint64_t now, Event &ev, uint64_t &at){
+            if(this->earliest > now) return false;
+            uint8_t _i = 0;
+            while(this->when[_i] != this->earliest) _i++;
+            ev = (Event)_i;
+            at = this->earliest;
+            this->cancel(ev);
+            return true;
+        }
+};
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef SERIAL_HPP
+#define SERIAL_HPP
+
+// シリアル通信（SB / SC）
+// 通信相手は接続されていないため、内部クロックでの転送のみ完了させ、受信データは0xFFになる
+#include "platform.hpp"
+#include "scheduler.hpp"
+#include "interrupts.hpp"
+
+// 8bitの転送にかかるTサイクル数（8192Hz × 8bit）
+const uint32_t SERIAL_TRANSFER_CYCLES = 512 * 8;
+
+class Serial {
+    private:
+        uint8_t sb;     // 送受信データ
+        uint8_t sc;     // 7bit目 : 転送中、0bit目 : 内部クロック
+
+    public:
+        // コンストラクタ
+        Serial(){
+            this->sb = 0;
+            this->sc = 0;
+        }
+
+        // シリアルのリード処理
+        inline uint8_t read(uint16_t addr){
+            if(0xFF01 == addr) return this->sb;
+            else if(0xFF02 == addr) return 0x7E | this->sc;
+            return 0xFF;
+        }
+
+        // シリアルのライト処理
+        inline void write(uint16_t addr, uint8_t val, uint64_t now, Scheduler &scheduler){
+            if(0xFF01 == addr) this->sb = val;
+            else if(0xFF02 == addr) {
+                this->sc = val & 0x81;
+                if(this->sc == 0x81) scheduler.schedule(EVENT_SERIAL, now + SERIAL_TRANSFER_CYCLES);
+                else scheduler.cancel(EVENT_SERIAL);
+            }
+        }
+
+        // 転送完了、シリアル割り込みを要求する
+        inline uint8_t on_event(uint64_t at, Scheduler &scheduler){
+            this->sb = 0xFF;
+            this->sc &= 0x7F;
+            return SERIAL;
+        }
+};
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef SPSC_RING_HPP
+#define SPSC_RING_HPP
+
+// コア間でデータを受け渡すリングバッファ（1プロデューサー・1コンシューマー）
+// 書き込み位置は書き込み側、読み出し位置は読み出し側だけが更新するため、ロックを使わずアトミックな読み書きだけで受け渡せる
+// 要素は直接書き込み・読み出しし、reserve → commit / front → pop の順で使う
+#include "platform.hpp"
+
+template<typename T, uint16_t N>
+class SpscRing {
+    static_assert((N & (N - 1)) == 0, "N must be a power of two");
+
+    private:
+        T slots[N];
+        uint32_t head;      // 書き込み位置（書き込み側のみ更新）
+        uint32_t tail;      // 読み出し位置（読み出し側のみ更新）
+
+    public:
+        // 書き込み側の統計
+        uint32_t pushed;    // 書き込んだ要素数
+        uint32_t dropped;   // 満杯で書き込めなかった回数
+        uint16_t peak;      // 書き込み時の最大の使用数
+
+        // コンストラクタ
+        SpscRing(){
+            this->head = 0;
+            this->tail = 0;
+            this->pushed = 0;
+            this->dropped = 0;
+            this->peak = 0;
+        }
+
+        //-------------------------------------------------------------------------------------
+        // 書き込み側
+
+        // 次に書き込む要素、満杯の場合は nullptr
+        inline T *reserve(){
+            uint16_t _used = this->head - __atomic_load_n(&this->tail, __ATOMIC_ACQUIRE);
+            if(_used >= N){
+                this->dropped++;
+                return nullptr;
+            }
+            if(_used + 1 > this->peak) this->peak = _used + 1;
+            return &this->slots[this->head & (N - 1)];
+        }
+
+        // reserve で得た要素の書き込みを完了し、読み出し側に渡す
+        inline void commit(){
+            this->pushed++;
+            __atomic_store_n(&this->head, this->head + 1, __ATOMIC_RELEASE);
+        }
+
+        //-------------------------------------------------------------------------------------
+        // 読み出し側
+
+        // 次に読み出す要素、空の場合は nullptr
+        inline const T *front(){
+            if(this->tail == __atomic_load_n(&this->head, __ATOMIC_ACQUIRE)) return nullptr;
+            return &this->slots[this->tail & (N - 1)];
+        }
+
+        // front で得た要素の読み出しを完了し、書き込み側に返す
+        inline void pop(){
+            __atomic_store_n(&this->tail, this->tail + 1, __ATOMIC_RELEASE);
+        }
+};
+
+#endif
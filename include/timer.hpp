@@ -0,0 +1,96 @@
+#ifndef TIMER_HPP
+#define TIMER_HPP
+
+// タイマー（DIV / TIMA / TMA / TAC）
+// 毎サイクル数えずに、基準のサイクルからの経過で値を求める
+// TIMAのオーバーフローのみスケジューラに登録する
+#include "platform.hpp"
+#include "scheduler.hpp"
+#include "interrupts.hpp"
+
+// TACのクロック選択毎の、TIMAが1増えるまでのTサイクル数（2の累乗のbit数）
+// 00 : 4096Hz（1024）、01 : 262144Hz（16）、10 : 65536Hz（64）、11 : 16384Hz（256）
+const uint8_t TIMER_SHIFT[4] = {10, 4, 6, 8};
+const uint8_t TIMER_ENABLE = 1 << 2;
+
+class Timer {
+    private:
+        uint64_t div_base;      // DIVの内部カウンタが0だったサイクル
+        uint64_t tima_base;     // tima を記録したサイクル
+        uint8_t tima;
+        uint8_t tma;
+        uint8_t tac;
+
+        // 内部カウンタの選択bitの立ち下がり回数（div_base からの累計）
+        inline uint64_t ticks(uint64_t at){
+            return (at - this->div_base) >> TIMER_SHIFT[this->tac & 3];
+        }
+        // at 時点のTIMA
+        inline uint8_t tima_at(uint64_t at){
+            if((this->tac & TIMER_ENABLE) == 0) return this->tima;
+            return (uint8_t)(this->tima + (this->ticks(at) - this->ticks(this->tima_base)));
+        }
+        // now 時点のTIMAを記録し、オーバーフローするサイクルを登録し直す
+        inline void reschedule(uint64_t now, Scheduler &scheduler){
+            this->tima = this->tima_at(now);
+            this->tima_base = now;
+            if((this->tac & TIMER_ENABLE) == 0){
+                scheduler.cancel(EVENT_TIMER);
+                return;
+            }
+            uint64_t _overflow = this->ticks(now) + (0x100 - this->tima);
+            scheduler.schedule(EVENT_TIMER, this->div_base + (_overflow << TIMER_SHIFT[this->tac & 3]));
+        }
+
+    public:
+        // コンストラクタ
+        Timer(){
+            this->div_base = 0;
+            this->tima_base = 0;
+            this->tima = 0;
+            this->tma = 0;
+            this->tac = 0;
+        }
+
+        // タイマーのリード処理
+        inline uint8_t read(uint16_t addr, uint64_t now){
+            if(0xFF04 == addr) return (uint8_t)((now - this->div_base) >> 8);
+            else if(0xFF05 == addr) return this->tima_at(now);
+            else if(0xFF06 == addr) return this->tma;
+            else if(0xFF07 == addr) return 0xF8 | this->tac;
+            return 0xFF;
+        }
+
+        // タイマーのライト処理
+        inline void write(uint16_t addr, uint8_t val, uint64_t now, Scheduler &scheduler){
+            if(0xFF04 == addr) {
+                // DIVは書き込むと0になる
+                this->tima = this->tima_at(now);
+                this->div_base = now;
+                this->tima_base = now;
+                this->reschedule(now, scheduler);
+            }
+            else if(0xFF05 == addr) {
+                this->tima = val;
+                this->tima_base = now;
+                this->reschedule(now, scheduler);
+            }
+            else if(0xFF06 == addr) this->tma = val;
+            else if(0xFF07 == addr) {
+                this->tima = this->tima_at(now);
+                this->tima_base = now;
+                this->tac = val & 0x07;
+                this->reschedule(now, scheduler);
+            }
+        }
+
+        // TIMAのオーバーフロー、TMAの値を読み込んでタイマー割り込みを要求する
+        inline uint8_t on_event(uint64_t at, Scheduler &scheduler){
+            this->tima = this->tma;
+            this->tima_base = at;
+            this->reschedule(at, scheduler);
+            return TIMER;
+        }
+};
+
+#endif
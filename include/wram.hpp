@@ -14,6 +14,11 @@ class WRam{
             this->wram[addr & 0x1fff] = val;
         }
 
+        // ページテーブル用、addr に対応するRAMのポインタ
+        inline uint8_t *get_ptr(uint16_t addr){
+            return &this->wram[addr & 0x1fff];
+        }
+
 };
 
 #endif
\ No newline at end of file
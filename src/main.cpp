@@ -1,9 +1,13 @@
 #include <Arduino.h>
 #include <hardware/structs/systick.h>
+#include <pico/time.h>
+#include <pico/mutex.h>
 #include <RP2040_PIO_GFX.h>
 #include "peripherals.hpp"
 #include "cpu.hpp"
 #include "cartridge.hpp"
+#include "scaler.hpp"
+#include "frame_skip.hpp"
 #include "LittleFS.h"
 
 
@@ -21,6 +25,8 @@ RP2040_PIO_GFX::Gfx gfx;
 Peripherals mmio;
 Cartridge cart;
 Cpu cpu;
+Scaler scaler;
+FrameSkip frame_skip;
 
 
 
@@ -28,6 +34,63 @@ Cpu cpu;
 uint8_t isBOOTSEL = 0;
 
 char _buf[20];
+uint8_t last_mode = 0;        // 最後に表示したモード（isBOOTSEL）
+uint32_t startup_us = 0;      // ROMの読み込み～周辺機器の初期化にかかった時間
+uint32_t save_max_us = 0;     // セーブファイルへの1回の書き込みにかかった最大時間（core0 が止まる時間の上限）
+
+// core0のPPUから受け取ったフレーム、core1のみ参照する
+uint16_t display_frame[SCREEN_HEIGHT][SCREEN_WIDTH];
+uint32_t display_dirty[LINE_DIRTY_WORDS];   // 表示用のバッファに書き込んでいないラインのbit
+bool frame_ready = false;                   // フレームの終わりを受け取り、表示待ち
+
+// デバッグ表示（モード0・1）で表示中の文字（8ドット単位）
+char overlay_text[HEIGHT / 8][WIDTH / 8];
+bool overlay_changed = false;               // 表示中の文字から変わった文字が有る
+// デバッグ表示の値（レジスタ・カウンタ）を更新する間隔（表示の回数）
+// 値は毎フレーム変わるため、毎回更新するとゲーム画面が止まっていてもLCDへの転送が毎フレーム発生する
+const uint8_t OVERLAY_INTERVAL = 30;
+uint8_t overlay_frames = OVERLAY_INTERVAL;  // 前回デバッグ表示の値を更新してからの表示の回数
+
+// デバッグ表示の文字列を書き込み、表示中の文字から変わった場合は overlay_changed を立てる
+// ゲーム画面の上に重ねるため、変わっていない文字も毎回書き込む（LCDへの転送は変わった場合のみ）
+void drawText(uint8_t col, uint8_t row, const char *text){
+  gfx.writeFont8(col, row, text);
+  for(uint8_t i = 0; text[i] != '\0' && col + i < WIDTH / 8; i++){
+    if(overlay_text[row][col + i] != text[i]){
+      overlay_text[row][col + i] = text[i];
+      overlay_changed = true;
+    }
+  }
+}
+
+// 表示中の文字を書き直す（値を更新しない表示で、書き込んだゲーム画面の上にデバッグ表示を重ねる）
+void redrawText(){
+  char _ch[2] = {0, 0};
+  for(uint8_t r = 0; r < HEIGHT / 8; r++){
+    for(uint8_t c = 0; c < WIDTH / 8; c++){
+      if(overlay_text[r][c] == '\0') continue;
+      _ch[0] = overlay_text[r][c];
+      gfx.writeFont8(c, r, _ch);
+    }
+  }
+}
+
+// PPUから完成したラインを受け取る
+// フレームの終わりを受け取った後は、表示するまで次のフレームのラインを受け取らない
+// 受け取れなかったラインはPPU側で送り直し、それまでフレームの終わりは送られないため、2つのフレームのラインが混ざって表示されることはない
+void receiveLines(){
+    const ScanLine *_line;
+    while(!frame_ready && (_line = mmio.ppu.lines.front()) != nullptr){
+      if(_line->ly >= SCREEN_HEIGHT){
+        frame_ready = true;
+      } else {
+        memcpy(display_frame[_line->ly], _line->pixels, sizeof(_line->pixels));
+        display_dirty[_line->ly >> 5] |= 1u << (_line->ly & 31);
+      }
+      mmio.ppu.lines.pop();
+    }
+}
+
 void dispFunc(){
     // 描画指示
     //gfx.swap();
@@ -35,86 +98,134 @@ void dispFunc(){
     //gfx.clear(gfx.BLACK);
 
     // 描画
-    mmio.ppu.render_bg(WIDTH, HEIGHT, gfx.getWriteBuffer()); 
-
-    if(isBOOTSEL == 0){
+    // PPUから受け取ったフレームを、フレームの終わりまで揃った場合のみ1.5倍に拡大して書き込む
+    // 書き込むのは前回から変わったラインのみで、変化が無ければLCDへの転送も行わない
+    // モードを切り替えた場合は表示用のバッファが書き換わっているため、消去して全ラインを書き込み直す
+    // デバッグ表示も、表示中の文字・VRAMの内容から変わった場合のみ転送する
+    // デバッグ表示（モード0・1）の値は OVERLAY_INTERVAL 回毎にのみ更新し、その間はゲーム画面の変化だけが転送の契機になる
+    bool _changed = false;
+    if(isBOOTSEL != last_mode){
+      last_mode = isBOOTSEL;
+      gfx.clear(gfx.BLACK);
+      for(uint8_t w = 0; w < LINE_DIRTY_WORDS; w++) display_dirty[w] = 0xFFFFFFFF;
+      memset(overlay_text, 0, sizeof(overlay_text));
+      overlay_frames = OVERLAY_INTERVAL;
+      _changed = true;
+    }
+    // VRAM表示（モード2）は画面全体を上書きするため、ゲーム画面は書き込まない
+    if(frame_ready){
+      if(isBOOTSEL != 2){
+        if(scaler.scale(display_frame, display_dirty, WIDTH, HEIGHT, gfx.getWriteBuffer()) > 0) _changed = true;
+        for(uint8_t w = 0; w < LINE_DIRTY_WORDS; w++) display_dirty[w] = 0;
+      }
+      frame_ready = false;
+    }
+    overlay_changed = false;
+    bool _refresh = ++overlay_frames >= OVERLAY_INTERVAL;
+    if(_refresh) overlay_frames = 0;
+
+    if(isBOOTSEL <= 1 && !_refresh){
+      // 値を更新しない表示、ゲーム画面を書き込んだ場合はデバッグ表示を上に重ね直す
+      if(_changed) redrawText();
+    } else if(isBOOTSEL == 0){
       snprintf(_buf, 8, "%X", cpu.regs.pc);
-      gfx.writeFont8(0, 0, "PC:");
-      gfx.writeFont8(4, 0, _buf);
+      drawText(0, 0, "PC:");
+      drawText(4, 0, _buf);
       snprintf(_buf, 8, "%X", cpu.ctx.opecode);
-      gfx.writeFont8(10, 0, "OP:");
-      gfx.writeFont8(14, 0, _buf);
+      drawText(10, 0, "OP:");
+      drawText(14, 0, _buf);
       //
       snprintf(_buf, 8, "%X", cpu.regs.a);
-      gfx.writeFont8(0, 1, "A:");
-      gfx.writeFont8(3, 1, _buf);
+      drawText(0, 1, "A:");
+      drawText(3, 1, _buf);
       snprintf(_buf, 8, "%X", cpu.regs.b);
-      gfx.writeFont8(0, 2, "B:");
-      gfx.writeFont8(3, 2, _buf);
+      drawText(0, 2, "B:");
+      drawText(3, 2, _buf);
       snprintf(_buf, 8, "%X", cpu.regs.c);
-      gfx.writeFont8(0, 3, "C:");
-      gfx.writeFont8(3, 3, _buf);
+      drawText(0, 3, "C:");
+      drawText(3, 3, _buf);
       snprintf(_buf, 8, "%X", cpu.regs.d);
-      gfx.writeFont8(0, 4, "D:");
-      gfx.writeFont8(3, 4, _buf);
+      drawText(0, 4, "D:");
+      drawText(3, 4, _buf);
       //
       snprintf(_buf, 8, "%X", cpu.regs.e);
-      gfx.writeFont8(10, 1, "E:");
-      gfx.writeFont8(13, 1, _buf);
-      snprintf(_buf, 8, "%X", cpu.regs.f);
-      gfx.writeFont8(10, 2, "F:");
-      gfx.writeFont8(13, 2, _buf);
+      drawText(10, 1, "E:");
+      drawText(13, 1, _buf);
+      snprintf(_buf, 8, "%X", cpu.regs.flags());      // core0 のレジスタを書き換えないよう af() は使わない
+      drawText(10, 2, "F:");
+      drawText(13, 2, _buf);
       snprintf(_buf, 8, "%X", cpu.regs.h);
-      gfx.writeFont8(10, 3, "H:");
-      gfx.writeFont8(13, 3, _buf);
+      drawText(10, 3, "H:");
+      drawText(13, 3, _buf);
       snprintf(_buf, 8, "%X", cpu.regs.l);
-      gfx.writeFont8(10, 4, "L:");
-      gfx.writeFont8(13, 4, _buf);
+      drawText(10, 4, "L:");
+      drawText(13, 4, _buf);
       //
-      snprintf(_buf, 16, "%d", cpu.cycle);
-      gfx.writeFont8(0, 5, "CY:");
-      gfx.writeFont8(4, 5, _buf);
+      snprintf(_buf, 16, "%llu", (unsigned long long)cpu.cycle);
+      drawText(0, 5, "CY:");
+      drawText(4, 5, _buf);
       //snprintf(_buf, 16, "%X", cpu.regs.sp);
       //gfx.writeFont8(10, 5, "SP:");
       //gfx.writeFont8(13, 5, _buf);
       //
       snprintf(_buf, 16, "%x", cart.header.cartridge_type);
-      gfx.writeFont8(0, 6, "TI:");
-      gfx.writeFont8(4, 6, _buf);
+      drawText(0, 6, "TI:");
+      drawText(4, 6, _buf);
       //
       snprintf(_buf, 16, "%d", mmio.ppu.dVal);
-      gfx.writeFont8(0, 7, "DE:");
-      gfx.writeFont8(4, 7, _buf);
+      drawText(0, 7, "DE:");
+      drawText(4, 7, _buf);
+      // ラインのリングの最大使用数 / 満杯で送れなかった回数 / 送れなかったフレームの数
+      snprintf(_buf, 20, "%u/%lu/%lu", mmio.ppu.lines.peak, (unsigned long)mmio.ppu.lines.dropped, (unsigned long)mmio.ppu.frames_dropped);
+      drawText(0, 8, "RB:");
+      drawText(4, 8, _buf);
+      // 描画したフレーム数 / 省略したフレーム数
+      snprintf(_buf, 20, "%lu/%lu", (unsigned long)frame_skip.rendered, (unsigned long)frame_skip.skipped);
+      drawText(0, 9, "FS:");
+      drawText(4, 9, _buf);
+      // 起動時間（us）
+      snprintf(_buf, 16, "%lu", (unsigned long)startup_us);
+      drawText(0, 10, "ST:");
+      drawText(4, 10, _buf);
+      // セーブファイルに書き込んだ回数 / ページ数 / 1回の書き込みの最大時間（us）
+      snprintf(_buf, 20, "%lu/%lu/%lu", (unsigned long)cart.save_ram.flushes, (unsigned long)cart.save_ram.pages, (unsigned long)save_max_us);
+      drawText(0, 11, "SV:");
+      drawText(4, 11, _buf);
     } else if(isBOOTSEL == 1) {
       // hram表示
       uint8_t _cnt = 0;
       for(int s = 0; s < 16; s++){
         for(int i = 0; i < 8; i++){
           snprintf(_buf, 16, "%X", mmio.hram.read(_cnt));
-          gfx.writeFont8(i * 3, s, _buf);
+          drawText(i * 3, s, _buf);
           _cnt++;
         }
       }
     } else if(isBOOTSEL == 2){
       // vram表示
+      // core0 が書き換え中のVRAMは直接読まず、フレームの終わりに core0 から受け取った写しを表示する
       
-      uint16_t color = 0;
-      for(int r = 0; r < HEIGHT; r++){
-        for(int c = 0; c < WIDTH; c++){
-          uint16_t tile_idx = mmio.ppu.get_tile_idx_from_tile_map(0, r >> 3, c >> 3);
-          uint8_t pixel = mmio.ppu.get_pixel_from_tile(tile_idx, r & 7, c & 7);
-          switch (0xFC >> (pixel << 1) & 0b11)
-          {
-              case 0b00: color = 0xFFFF; break;
-              case 0b01: color = 0xAD55; break;
-              case 0b10: color = 0x52AA; break;
-              default: color = 0x0000; break;
+      // タイルの1行（8ピクセル）単位で取得する
+      const VramSnapshot *_snap = mmio.ppu.vram_snapshots.front();
+      if(_snap != nullptr){
+        uint16_t *p = gfx.getWriteBuffer();
+        for(int r = 0; r < HEIGHT; r++){
+          for(int c = 0; c < WIDTH; c += 8){
+            uint16_t tile_idx = _snap->get_tile_idx_from_tile_map(0, r >> 3, c >> 3);
+            uint16_t pixels = _snap->get_tile_row(tile_idx, r & 7);
+            for(int i = 0; i < 8; i++){
+              uint16_t _color = SHADE_COLOR[(0xFC >> ((pixels & 0b11) << 1)) & 0b11];
+              if(p[(WIDTH * r) + c + i] != _color){
+                p[(WIDTH * r) + c + i] = _color;
+                _changed = true;
+              }
+              pixels >>= 2;
+            }
           }
-          uint16_t *p = gfx.getWriteBuffer();
-          p[(WIDTH * r) + c] = color;
-
         }
+        mmio.ppu.vram_snapshots.pop();
       }
+      mmio.ppu.request_vram();
       
       /*
       uint16_t _cnt = 0;
@@ -128,7 +239,7 @@ void dispFunc(){
       */
     }
 
-    gfx.updata();
+    if(_changed || overlay_changed) gfx.updata();
 }
 
 
@@ -157,35 +268,135 @@ void setup() {
 }
 
 
-uint8_t rom[32768] = {0};
+// ROMの読み込み元
+// 定義した場合は board_build.embed_files でフラッシュに埋め込んだROMを、XIPの領域からコピーせずに直接参照する
+// 未定義の場合はLittleFSのROMファイルから、バンクをキャッシュが必要になった時点でまとめて読み込む
+#define ROM_EMBEDDED
+#ifdef ROM_EMBEDDED
+extern "C" const uint8_t _binary_data_11_gb_start[];
+extern "C" const uint8_t _binary_data_11_gb_end[];
+#endif
+
+File rom_file;
+RomCache rom_cache;
+File save_file;
+// LittleFSは複数のコアから同時に使えないため、ROMファイルの読み込み（core0）とセーブファイルの書き込み（core1）で排他する
+auto_init_mutex(fs_mutex);
+
+// RomCache・SaveRam用のファイルの読み出し
+bool readRomFile(void *ctx, uint32_t offset, uint8_t *dst, uint32_t size){
+  File *_file = (File *)ctx;
+  mutex_enter_blocking(&fs_mutex);
+  bool _ok = _file->seek(offset) && _file->read(dst, size) == size;
+  mutex_exit(&fs_mutex);
+  return _ok;
+}
+
+// SaveRam用のセーブファイルへの書き込み
+bool writeSaveFile(void *ctx, uint32_t offset, const uint8_t *src, uint32_t size){
+  File *_file = (File *)ctx;
+  if(!_file->seek(offset)) return false;
+  return _file->write(src, size) == size;
+}
+
+// ビルドした時刻（UNIX時間、__DATE__・__TIME__ から求める）
+uint64_t buildTime(){
+  static const char MONTHS[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  const char *_date = __DATE__;       // "Mmm dd yyyy"
+  const char *_time = __TIME__;       // "hh:mm:ss"
+  int _month = 1;
+  while(_month < 12 && strncmp(&MONTHS[(_month - 1) * 3], _date, 3) != 0) _month++;
+  int _day = atoi(&_date[4]);
+  int _year = atoi(&_date[7]);
+  // 1970年1月1日からの日数（3月始まりの暦で計算する）
+  int _y = _year - (_month <= 2);
+  int _era = _y / 400;
+  int _yoe = _y - _era * 400;
+  int _doy = (153 * (_month + (_month > 2 ? -3 : 9)) + 2) / 5 + _day - 1;
+  int64_t _days = (int64_t)_era * 146097 + _yoe * 365 + _yoe / 4 - _yoe / 100 + _doy - 719468;
+  return _days * 86400 + atoi(&_time[0]) * 3600 + atoi(&_time[3]) * 60 + atoi(&_time[6]);
+}
+uint64_t build_time = buildTime();
+
+// MBC3のRTCの時刻（秒）
+// 電池付きの時計が無いため、ビルドした時刻からの起動時間とする（wall_clock でない）
+// セーブファイルに保存した時刻がある場合はそこから続けて進むため、電源を切っていた間は時刻が進まない
+uint64_t rtcClock(){
+  return build_time + time_us_64() / 1000000;
+}
+
+// 受け渡されたSRAMのページをセーブファイルに書き込む（core1）
+// フラッシュの消去・書き込みの間は core0 もXIPからの読み出しが止まるため、書き込むのは変更のあったページを1セクタ分までとし、
+// かかった時間（core0 が止まる時間の上限）を記録する
+void saveSram(){
+  uint64_t _start = time_us_64();
+  mutex_enter_blocking(&fs_mutex);
+  uint8_t _pages = cart.save_ram.flush(&writeSaveFile, &save_file);
+  if(_pages > 0) save_file.flush();
+  mutex_exit(&fs_mutex);
+  if(_pages == 0) return;
+  uint32_t _us = time_us_64() - _start;
+  if(_us > save_max_us) save_max_us = _us;
+}
+
 bool my_debug = false;
 uint32_t ts = 0, te = 0;
 void loop() {
   
   // ROM load
-  uint32_t cnt = 0;
+  uint64_t _load_start = time_us_64();
   LittleFS.begin();
-  File file = LittleFS.open("/11.gb", "r");
-  while(file.available()){
-    rom[cnt] = file.read();
-    cnt++;
+#ifdef ROM_EMBEDDED
+  // フラッシュ上のROMをそのまま参照する（SRAMを使わず、読み込みも無い）
+  cart.loadRom(_binary_data_11_gb_start, _binary_data_11_gb_end - _binary_data_11_gb_start);
+#else
+  // 起動時はバンク0（ヘッダを含む）のみ読み込み、以降のバンクはバンク切り替えの際に読み込む
+  rom_file = LittleFS.open("/11.gb", "r");
+  rom_cache.open(&readRomFile, &rom_file, ROM_CACHE_SLOTS);
+  cart.loadRom(&rom_cache);
+#endif
+  // バッテリーバックアップ有りの場合はセーブファイルからSRAM（MBC3はRTCも）を読み込む
+  // 無い・容量が足りない場合は初期化したSRAMでセーブファイルを作り直す
+  if(cart.save_ram.battery){
+    save_file = LittleFS.open("/11.sav", "r+");
+    if(!cart.load_save(&readRomFile, &save_file, &rtcClock, false)){
+      save_file.close();
+      save_file = LittleFS.open("/11.sav", "w+");
+      save_file.write(cart.save_ram.data, cart.save_ram.file_size());
+      save_file.flush();
+    }
   }
-  file.close();
-
-  // カートリッジ生成
-  cart.loadRom(rom);
   mmio.setup(&cart);
+  startup_us = time_us_64() - _load_start;
 
   //
   //cpu.regs.pc = 0x100;
 
   // CPUループ
+  // 1フレーム分のTサイクルをまとめて実行する
+  // HALT・アイドルループの間は run_until 内で早送りされるため、実時間より先行した分は core0 をスリープさせる
+  uint64_t _start_us = time_us_64();
+  uint64_t _start_cycle = cpu.cycle;
   while(1){
     ts = get_cvr();
-    cpu.emulate_cycle(mmio);
+    cpu.run_until(mmio, cpu.cycle + FRAME_CYCLES);
     te = get_cvr();
     mmio.ppu.dVal = tick_diffs(ts, te);
 
+    // 実行したサイクルに相当する実時間（59.73Hz）まで待つ（WFEで待機し、割り込みやイベントで起きても再度待つ）
+    // 遅れている場合は次のフレームの描画を省略し、1フレーム以上遅れている場合は基準を現在時刻に合わせ、遅れを取り戻そうとしない
+    absolute_time_t _deadline = from_us_since_boot(_start_us + (cpu.cycle - _start_cycle) * 1000000 / CPU_CLOCK);
+    int64_t _late = absolute_time_diff_us(_deadline, get_absolute_time());
+    mmio.ppu.skip_frame = frame_skip.update(_late);
+    // SRAMの保存、書き込みが止まっていれば変更のあったページを core1 に受け渡す（ファイルへの書き込みは core1 で行う）
+    cart.end_frame();
+    if(_late < 0){
+      while(!best_effort_wfe_or_timeout(_deadline)){}
+    } else if(_late > (int64_t)FRAME_CYCLES * 1000000 / CPU_CLOCK){
+      _start_us = time_us_64();
+      _start_cycle = cpu.cycle;
+    }
+
     // Stop
     //if(cpu.ctx.opecode == 0x78) my_debug = true;
     //if(my_debug) delay(3000);
@@ -238,9 +449,12 @@ void loop1(){
       if(isBOOTSEL > 3) isBOOTSEL = 0;
     }
 
+    // ラインはLCDへの転送中も受け取り、転送が終わった時点で揃っているフレームを表示する
+    receiveLines();
     if(gfx.isCompletedTransfer()){
       dispFunc();
     }
+    saveSram();
   }
   
 }
\ No newline at end of file
@@ -0,0 +1,612 @@
+// ネイティブ（Linux）向けのCPUスループット計測
+// 実機に書き込まずに Cpu / Peripherals の性能を確認するためのもの
+//
+// 使い方 : pio run -e native && .pio/build/native/program [ROMファイル] [フレーム数]
+//   ROMファイルを省略した場合は空のカートリッジ（ブートROMのみ）で計測する
+//
+// 描画の確認 : .pio/build/native/program --golden src/native/golden.txt [--update] [ROMファイル] [フレーム数]
+//   PPUの描画結果（フレーム毎のハッシュ）をゴールデンファイルと比較し、描画経路毎の速度を表示する
+//   --update を付けた場合、一致しなかった・記録の無いハッシュでゴールデンファイルを書き換える
+//
+// セーブの確認 : .pio/build/native/program --save <セーブファイル> ROMファイル [フレーム数]
+//   バッテリーバックアップ有りのROMを実行し、SRAMをセーブファイル（通常のファイル）から読み込み、変更のあったページを書き込む
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "peripherals.hpp"
+#include "cpu.hpp"
+#include "cartridge.hpp"
+#include "scaler.hpp"
+
+// 命令の分類
+enum OpClass {
+  LD8, LD16, ALU8, INCDEC, ALU16, CB, JUMP, CALLRET, STACK, MISC, OP_CLASS_NUM
+};
+const char *OP_CLASS_NAME[OP_CLASS_NUM] = {
+  "ld8", "ld16", "alu8", "inc/dec", "alu16", "cb", "jump", "call/ret", "stack", "misc"
+};
+
+// オペコードから分類を求める（x/y/zのbitフィールドで判定）
+OpClass op_class(uint8_t op, bool cb){
+  if(cb) return CB;
+  uint8_t x = op >> 6, y = (op >> 3) & 7, z = op & 7, q = y & 1;
+  switch(x){
+    case 0:
+      if(z == 0) return (y == 0 || y == 2) ? MISC : (y == 1 ? LD16 : JUMP);
+      if(z == 1) return q == 0 ? LD16 : ALU16;
+      if(z == 2 || z == 6) return LD8;
+      if(z == 3) return ALU16;
+      if(z == 4 || z == 5) return INCDEC;
+      return y < 4 ? ALU8 : MISC;
+    case 1:
+      return op == 0x76 ? MISC : LD8;
+    case 2:
+      return ALU8;
+    default:
+      if(z == 0) return y < 4 ? CALLRET : (y == 5 || y == 7 ? ALU16 : LD8);
+      if(z == 1) return q == 0 ? STACK : (y == 1 || y == 3 ? CALLRET : (y == 5 ? JUMP : LD16));
+      if(z == 2) return y < 4 ? JUMP : LD8;
+      if(z == 3) return y == 0 ? JUMP : MISC;
+      if(z == 4) return CALLRET;
+      if(z == 5) return q == 0 ? STACK : CALLRET;
+      if(z == 6) return ALU8;
+      return CALLRET;
+  }
+}
+
+// 計測対象一式
+struct Machine {
+  Peripherals mmio;
+  Cartridge cart;
+  Cpu cpu;
+};
+
+// ROMイメージ（メモリ上のROM全体）
+struct RomImage {
+  const uint8_t *data;
+  uint32_t size;
+};
+
+// ROMを読み込んでマシンを生成する、ROMはコピーせずに参照する
+Machine *create_machine(const RomImage &rom){
+  Machine *m = new Machine();
+  m->cart.loadRom(rom.data, rom.size);
+  m->mmio.setup(&m->cart);
+  return m;
+}
+
+Machine *create_machine(std::vector<uint8_t> &rom){
+  return create_machine(RomImage{rom.data(), (uint32_t)rom.size()});
+}
+
+// ROMファイルをメモリにコピーする（32KB未満は0で埋める）
+bool copy_rom(const char *path, std::vector<uint8_t> &rom){
+  FILE *fp = fopen(path, "rb");
+  if(fp == NULL) return false;
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  rom.assign(size > 0x8000 ? size : 0x8000, 0x00);
+  bool ok = size <= 0 || fread(rom.data(), 1, size, fp) == (size_t)size;
+  fclose(fp);
+  return ok;
+}
+
+// ROMファイルを mmap で読み出し専用に割り当てる（実機でフラッシュのROMを直接参照するのと同じ形）
+// 通常のファイルでない場合や32KB未満の場合は false
+bool map_rom(const char *path, RomImage &rom){
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) return false;
+  struct stat st;
+  if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < 0x8000){
+    close(fd);
+    return false;
+  }
+  void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(p == MAP_FAILED) return false;
+  rom.data = (const uint8_t *)p;
+  rom.size = (uint32_t)st.st_size;
+  return true;
+}
+
+void unmap_rom(RomImage &rom){
+  munmap((void *)rom.data, rom.size);
+}
+
+double now_sec(){
+  using namespace std::chrono;
+  return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+//---------------------------------------------------------------------------------------------
+// 命令種別毎のマイクロベンチマーク
+// 0x0150 から body を繰り返し並べ、末尾で 0x0150 にジャンプするループを実行する
+// ループの大きさはゲームのメインループ程度（数百バイト）
+const uint16_t KERNEL_SIZE = 512;
+
+struct Kernel {
+  const char *name;
+  std::vector<uint8_t> body;
+};
+
+double run_kernel(const Kernel &k, uint32_t frames){
+  std::vector<uint8_t> rom(0x8000, 0x00);
+  uint16_t pc = 0x0150;
+  while(pc + k.body.size() + 3 < 0x0150 + KERNEL_SIZE){
+    for(size_t i = 0; i < k.body.size(); i++) rom[pc + i] = k.body[i];
+    pc += k.body.size();
+  }
+  rom[pc] = 0xC3; rom[pc + 1] = 0x50; rom[pc + 2] = 0x01;         // jp 0x0150
+  rom[0x3F00] = 0xC9;                                             // call用のサブルーチン（ret）
+
+  Machine *m = create_machine(rom);
+  m->mmio.write(0xFF50, 0x01);                                     // ブートROMを無効化
+  m->cpu.regs.pc = 0x0150;
+  m->cpu.regs.sp = 0xFFFE;
+  m->cpu.regs.write_hl(0xC000);
+
+  uint64_t target = m->cpu.cycle + (uint64_t)FRAME_CYCLES * frames;
+  uint64_t count = 0;
+  double t0 = now_sec();
+  while(m->cpu.cycle < target){
+    m->cpu.execute(m->mmio);
+    count++;
+  }
+  double t1 = now_sec();
+  delete m;
+  return (t1 - t0) * 1e9 / (double)count;
+}
+
+void bench_kernels(uint32_t frames){
+  const std::vector<Kernel> kernels = {
+    {"ld8",      {0x41, 0x4A, 0x53, 0x5C, 0x78, 0x47, 0x3E, 0x12, 0x06, 0x34}},
+    {"ld (hl)",  {0x7E, 0x77, 0x46, 0x70, 0x2A, 0x2B, 0x32, 0x23, 0xF0, 0x80, 0xE0, 0x81}},
+    {"alu8",     {0x80, 0x91, 0xA2, 0xAB, 0xB4, 0xBD, 0x88, 0x99, 0xC6, 0x12, 0xFE, 0x34}},
+    {"inc/dec",  {0x04, 0x0D, 0x14, 0x1D, 0x3C, 0x3D, 0x03, 0x1B}},
+    {"alu16",    {0x09, 0x19, 0xE8, 0x00, 0xF8, 0x00}},
+    {"cb",       {0xCB, 0x00, 0xCB, 0x4F, 0xCB, 0xD2, 0xCB, 0x8B, 0xCB, 0x37, 0xCB, 0x3C}},
+    {"jump",     {0x18, 0x00, 0x20, 0x00, 0x28, 0x00, 0x30, 0x00}},
+    {"call/ret", {0xCD, 0x00, 0x3F}},
+    {"stack",    {0xC5, 0xC1, 0xD5, 0xD1, 0xE5, 0xE1}},
+  };
+
+  printf("\n[opcode class kernels] %u frames each\n", frames);
+  for(const Kernel &k : kernels){
+    printf("  %-10s %8.2f ns/instr\n", k.name, run_kernel(k, frames));
+  }
+}
+
+//---------------------------------------------------------------------------------------------
+// ライン描画のみを計測する
+// VRAMを乱数のタイルとタイルマップで埋め、スクロールの端数ありで全ラインを描画する
+void bench_render(uint32_t frames){
+  // bgのみ / window・スプライト40個（1ライン10個）を有効にした場合
+  for(uint8_t layers = 0; layers < 2; layers++){
+    std::vector<uint8_t> rom(0x8000, 0x00);
+    Machine *m = create_machine(rom);
+    srand(1);
+    for(uint16_t addr = 0x8000; addr < 0xA000; addr++) m->mmio.write(addr, rand() & 0xFF);
+    m->mmio.write(0xFF40, 0x91);
+    m->mmio.write(0xFF47, 0xE4);
+    m->mmio.write(0xFF42, 5);
+    m->mmio.write(0xFF43, 3);
+    if(layers){
+      for(uint8_t i = 0; i < SPRITE_NUM; i++){
+        m->mmio.write(0xFE00 + i * 4, 16 + (i / 10) * 36 + (i % 10) * 2);
+        m->mmio.write(0xFE01 + i * 4, 8 + (i % 10) * 16);
+        m->mmio.write(0xFE02 + i * 4, rand() & 0xFF);
+        m->mmio.write(0xFE03 + i * 4, rand() & 0xF0);
+      }
+      m->mmio.write(0xFF48, 0xD2);
+      m->mmio.write(0xFF49, 0x1B);
+      m->mmio.write(0xFF4A, 72);
+      m->mmio.write(0xFF4B, 83);
+      m->mmio.write(0xFF40, 0xF7);
+    }
+
+    double t0 = now_sec();
+    for(uint32_t f = 0; f < frames; f++){
+      for(uint8_t ly = 0; ly < SCREEN_HEIGHT; ly++){
+        m->mmio.io[IO_LY] = ly;
+        m->mmio.ppu.render_line();
+        // 表示側の代わりにリングを空にする
+        while(m->mmio.ppu.lines.front() != nullptr) m->mmio.ppu.lines.pop();
+      }
+    }
+    double t1 = now_sec();
+    uint32_t sum = 0;
+    for(uint8_t r = 0; r < SCREEN_HEIGHT; r++) for(uint8_t c = 0; c < SCREEN_WIDTH; c++) sum += m->mmio.ppu.frame[r][c];
+    delete m;
+
+    printf("\n[%s render] %u frames\n", layers ? "bg+window+sprite" : "bg", frames);
+    printf("  ns/line    : %.1f\n", (t1 - t0) * 1e9 / ((double)frames * SCREEN_HEIGHT));
+    printf("  checksum   : %08x\n", sum);
+  }
+}
+
+//---------------------------------------------------------------------------------------------
+// 160×144 → 240×240 の拡大（全ラインが変化した場合）
+void bench_scale(uint32_t frames){
+  static uint16_t frame[SCREEN_HEIGHT][SCREEN_WIDTH];
+  static uint16_t lcd[240 * 240];
+  srand(1);
+  for(uint8_t r = 0; r < SCREEN_HEIGHT; r++) for(uint8_t c = 0; c < SCREEN_WIDTH; c++) frame[r][c] = SHADE_COLOR[rand() & 3];
+  uint32_t dirty[LINE_DIRTY_WORDS];
+  for(uint8_t w = 0; w < LINE_DIRTY_WORDS; w++) dirty[w] = 0xFFFFFFFF;
+
+  Scaler scaler;
+  for(uint8_t mode = 0; mode < 2; mode++){
+    scaler.mode = (ScaleMode)mode;
+    double t0 = now_sec();
+    for(uint32_t f = 0; f < frames; f++) scaler.scale(frame, dirty, 240, 240, lcd);
+    double t1 = now_sec();
+    uint32_t sum = 0;
+    for(uint32_t i = 0; i < 240 * 240; i++) sum += lcd[i];
+
+    printf("\n[scale %s] %u frames\n", mode ? "blend" : "nearest", frames);
+    printf("  us/frame   : %.1f\n", (t1 - t0) * 1e6 / frames);
+    printf("  checksum   : %08x\n", sum);
+  }
+}
+
+//---------------------------------------------------------------------------------------------
+// ROMをヘッドレスで実行する
+void bench_rom(const RomImage &rom, uint32_t frames){
+  // 1回目 : run_until のみで実行時間を計測
+  Machine *m = create_machine(rom);
+  double t0 = now_sec();
+  for(uint32_t i = 0; i < frames; i++){
+    m->cpu.run_until(m->mmio, m->cpu.cycle + FRAME_CYCLES);
+  }
+  double t1 = now_sec();
+  uint64_t cycles = m->cpu.cycle;
+  uint64_t idle_cycles = m->cpu.idle_cycles;
+  delete m;
+
+  // 2回目 : 同じ条件で命令数と命令種別の内訳を数える（エミュレーションは決定的）
+  uint64_t count[OP_CLASS_NUM] = {0};
+  uint64_t total = 0;
+  m = create_machine(rom);
+  uint64_t target = m->cpu.cycle + (uint64_t)FRAME_CYCLES * frames;
+  while(m->cpu.cycle < target){
+    m->cpu.execute(m->mmio);
+    count[op_class(m->cpu.ctx.opecode, m->cpu.ctx.cb)]++;
+    total++;
+    m->cpu.fast_forward(m->mmio, target);
+  }
+  delete m;
+
+  double sec = t1 - t0;
+  printf("[rom run] %u frames, %.3f s\n", frames, sec);
+  printf("  T-cycles/s : %.0f (%.2fx realtime)\n", cycles / sec, cycles / sec / CPU_CLOCK);
+  printf("  frames/s   : %.1f\n", frames / sec);
+  printf("  ns/instr   : %.2f (%llu instr)\n", sec * 1e9 / total, (unsigned long long)total);
+  printf("  idle skip  : %.2f %% of T-cycles\n", 100.0 * idle_cycles / cycles);
+  printf("  instruction mix:\n");
+  for(int i = 0; i < OP_CLASS_NUM; i++){
+    printf("    %-10s %6.2f %%\n", OP_CLASS_NAME[i], 100.0 * count[i] / total);
+  }
+}
+
+
+//---------------------------------------------------------------------------------------------
+// ゴールデンフレームによる描画の確認
+// VRAM・OAM・レジスタのスナップショット（乱数から生成）をPPUに読み込み、フレーム毎にスクロールなどを変えながら描画する
+// 各フレームのハッシュをゴールデンファイルの記録と比較し、最適化の前後で描画結果が変わっていないことを確かめる
+
+// 環境に依存しない乱数（xorshift32）、スナップショットを常に同じ内容にする
+struct Random {
+  uint32_t state;
+  uint8_t next(){
+    this->state ^= this->state << 13;
+    this->state ^= this->state >> 17;
+    this->state ^= this->state << 5;
+    return (uint8_t)(this->state >> 8);
+  }
+};
+
+// フレームバッファのハッシュ（FNV-1a）
+uint32_t hash_frame(Ppu &ppu){
+  uint32_t h = 2166136261u;
+  for(uint8_t r = 0; r < SCREEN_HEIGHT; r++){
+    for(uint8_t c = 0; c < SCREEN_WIDTH; c++){
+      uint16_t px = ppu.frame[r][c];
+      h = (h ^ (px & 0xFF)) * 16777619u;
+      h = (h ^ (px >> 8)) * 16777619u;
+    }
+  }
+  return h;
+}
+
+// スナップショット、sprites はOAMに置くスプライト数（0の場合はOAMを空にする）
+struct Snapshot {
+  const char *name;
+  uint8_t lcdc;
+  uint8_t sprites;
+};
+
+// スナップショットを読み込む
+void load_snapshot(Machine *m, const Snapshot &snap){
+  Random rnd = {0x9E3779B9u ^ snap.lcdc};
+  for(uint16_t addr = 0x8000; addr < 0xA000; addr++) m->mmio.write(addr, rnd.next());
+  for(uint8_t i = 0; i < SPRITE_NUM; i++){
+    bool _use = i < snap.sprites;
+    m->mmio.write(0xFE00 + i * 4, _use ? rnd.next() % 170 : 0);    // Y
+    m->mmio.write(0xFE01 + i * 4, _use ? rnd.next() % 176 : 0);    // X
+    m->mmio.write(0xFE02 + i * 4, rnd.next());                      // タイル
+    m->mmio.write(0xFE03 + i * 4, rnd.next() & 0xF0);               // 属性
+  }
+  m->mmio.write(0xFF40, snap.lcdc);
+  m->mmio.write(0xFF48, 0xD2);
+  m->mmio.write(0xFF49, 0x1B);
+}
+
+// フレーム f 用にレジスタを変える（スクロール・windowの位置・パレット）
+void vary_registers(Machine *m, uint32_t f){
+  m->mmio.write(0xFF42, f * 5);
+  m->mmio.write(0xFF43, f * 3);
+  m->mmio.write(0xFF4A, (f * 9) % 150);
+  m->mmio.write(0xFF4B, (f * 11) % 170);
+  m->mmio.write(0xFF47, (uint8_t)(0xE4 + f * 0x1B));
+}
+
+// 1フレーム分の全ラインを描画する（表示側の代わりにリングを空にする）
+void render_frame(Machine *m){
+  for(uint8_t ly = 0; ly < SCREEN_HEIGHT; ly++){
+    m->mmio.io[IO_LY] = ly;
+    m->mmio.ppu.render_line();
+    while(m->mmio.ppu.lines.front() != nullptr) m->mmio.ppu.lines.pop();
+  }
+}
+
+// ゴールデンファイル（1行に "名前 フレーム番号 ハッシュ"）の読み書き
+typedef std::map<std::string, uint32_t> Goldens;
+
+std::string golden_key(const std::string &name, uint32_t f){
+  return name + " " + std::to_string(f);
+}
+
+Goldens load_goldens(const char *path){
+  Goldens g;
+  FILE *fp = fopen(path, "r");
+  if(fp == NULL) return g;
+  char name[64];
+  uint32_t f, h;
+  while(fscanf(fp, "%63s %u %x", name, &f, &h) == 3) g[golden_key(name, f)] = h;
+  fclose(fp);
+  return g;
+}
+
+void save_goldens(const char *path, const Goldens &g){
+  FILE *fp = fopen(path, "w");
+  if(fp == NULL){
+    fprintf(stderr, "cannot write %s\n", path);
+    return;
+  }
+  for(const auto &e : g) fprintf(fp, "%s %08x\n", e.first.c_str(), e.second);
+  fclose(fp);
+}
+
+// 1つの描画経路の結果、ハッシュを比較して一致しなかったフレーム数を返す
+uint32_t check_hashes(const std::string &name, const std::vector<uint32_t> &hashes, Goldens &g, bool update, uint32_t &missing){
+  uint32_t _bad = 0;
+  for(uint32_t f = 0; f < hashes.size(); f++){
+    auto it = g.find(golden_key(name, f));
+    if(it == g.end()) missing++;
+    else if(it->second != hashes[f]){
+      if(_bad == 0) printf("    %s frame %u : %08x (golden %08x)\n", name.c_str(), f, hashes[f], it->second);
+      _bad++;
+    }
+    if(update) g[golden_key(name, f)] = hashes[f];
+  }
+  return _bad;
+}
+
+// ゴールデンフレームの確認、全て一致した場合に0を返す
+int run_golden(const char *path, bool update, const RomImage *rom, uint32_t frames){
+  const std::vector<Snapshot> snapshots = {
+    {"bg",            0x91, 0},
+    {"bg-signed",     0x89, 0},
+    {"window",        0xF1, 0},
+    {"sprite8",       0x93, 40},
+    {"sprite16",      0x97, 40},
+    {"all",           0xF7, 40},
+    {"bg-off",        0xB2, 40},
+  };
+  Goldens g = load_goldens(path);
+  uint32_t _bad = 0, _missing = 0;
+
+  printf("\n[golden] %s\n", path);
+  for(const Snapshot &snap : snapshots){
+    std::vector<uint8_t> empty(0x8000, 0x00);
+    Machine *m = create_machine(empty);
+    m->mmio.write(0xFF50, 0x01);
+    load_snapshot(m, snap);
+    std::vector<uint32_t> hashes;
+    double _time = 0;
+    for(uint32_t f = 0; f < frames; f++){
+      vary_registers(m, f);
+      double t0 = now_sec();
+      render_frame(m);
+      _time += now_sec() - t0;
+      hashes.push_back(hash_frame(m->mmio.ppu));
+    }
+    delete m;
+    uint32_t _b = check_hashes(snap.name, hashes, g, update, _missing);
+    _bad += _b;
+    printf("  %-12s %4u frames  %-8s %8.1f Mpixel/s\n", snap.name, frames, _b ? "MISMATCH" : "ok",
+           (double)frames * SCREEN_WIDTH * SCREEN_HEIGHT / _time / 1e6);
+  }
+
+  // ROMを実行した場合のフレーム、ROM毎に名前を分ける
+  if(rom != nullptr){
+    uint32_t _id = 2166136261u;
+    for(uint32_t i = 0; i < rom->size; i++) _id = (_id ^ rom->data[i]) * 16777619u;
+    char name[32];
+    snprintf(name, sizeof(name), "rom-%08x", _id);
+    Machine *m = create_machine(*rom);
+    std::vector<uint32_t> hashes;
+    for(uint32_t f = 0; f < frames; f++){
+      m->cpu.run_until(m->mmio, m->cpu.cycle + FRAME_CYCLES);
+      while(m->mmio.ppu.lines.front() != nullptr) m->mmio.ppu.lines.pop();
+      hashes.push_back(hash_frame(m->mmio.ppu));
+    }
+    delete m;
+    uint32_t _b = check_hashes(name, hashes, g, update, _missing);
+    _bad += _b;
+    printf("  %-12s %4u frames  %-8s\n", name, frames, _b ? "MISMATCH" : "ok");
+  }
+
+  if(update) save_goldens(path, g);
+  printf("  result     : %u mismatched, %u without golden%s\n", _bad, _missing, update ? " (updated)" : "");
+  return (_bad > 0 || (_missing > 0 && !update)) ? 1 : 0;
+}
+
+//---------------------------------------------------------------------------------------------
+// 起動時間（ROMの読み込み～マシンの初期化）の比較
+// ROMファイルをメモリにコピーする場合と、mmap で直接参照する場合
+void bench_startup(const char *path){
+  const uint32_t REPEAT = 20;
+  double copy_time = 0, map_time = 0;
+  for(uint32_t i = 0; i < REPEAT; i++){
+    double t0 = now_sec();
+    std::vector<uint8_t> rom;
+    copy_rom(path, rom);
+    Machine *m = create_machine(rom);
+    double t1 = now_sec();
+    delete m;
+
+    double t2 = now_sec();
+    RomImage image;
+    if(!map_rom(path, image)) return;
+    m = create_machine(image);
+    double t3 = now_sec();
+    delete m;
+    unmap_rom(image);
+
+    copy_time += t1 - t0;
+    map_time += t3 - t2;
+  }
+  printf("\n[startup] %s\n", path);
+  printf("  copy       : %.1f us\n", copy_time * 1e6 / REPEAT);
+  printf("  mmap       : %.1f us\n", map_time * 1e6 / REPEAT);
+}
+
+//---------------------------------------------------------------------------------------------
+// SRAMのセーブ
+// 実機の core0 / core1 と同じく、フレームの終わりに受け渡されたページをファイルに書き込む
+bool read_save_file(void *ctx, uint32_t offset, uint8_t *dst, uint32_t size){
+  FILE *fp = (FILE *)ctx;
+  if(fp == NULL || fseek(fp, offset, SEEK_SET) != 0) return false;
+  return fread(dst, 1, size, fp) == size;
+}
+
+bool write_save_file(void *ctx, uint32_t offset, const uint8_t *src, uint32_t size){
+  FILE *fp = (FILE *)ctx;
+  if(fseek(fp, offset, SEEK_SET) != 0) return false;
+  return fwrite(src, 1, size, fp) == size;
+}
+
+// MBC3のRTCの時刻（秒）、ホストの時計を使う
+uint64_t rtc_clock(){
+  return (uint64_t)time(nullptr);
+}
+
+int run_save(const char *path, const RomImage &rom, uint32_t frames){
+  Machine *m = create_machine(rom);
+  SaveRam &save = m->cart.save_ram;
+  if(!save.battery){
+    fprintf(stderr, "cartridge type %02X has no battery-backed SRAM\n", m->cart.header.cartridge_type);
+    delete m;
+    return 1;
+  }
+  // 無い・容量が足りない場合は初期化したSRAMで作り直す
+  FILE *fp = fopen(path, "r+b");
+  bool loaded = m->cart.load_save(&read_save_file, fp, &rtc_clock, true);
+  if(!loaded){
+    if(fp != NULL) fclose(fp);
+    fp = fopen(path, "w+b");
+    if(fp == NULL){
+      fprintf(stderr, "cannot open %s\n", path);
+      delete m;
+      return 1;
+    }
+    fwrite(save.data, 1, save.file_size(), fp);
+  }
+
+  double t0 = now_sec();
+  double flush_time = 0;
+  for(uint32_t i = 0; i < frames; i++){
+    m->cpu.run_until(m->mmio, m->cpu.cycle + FRAME_CYCLES);
+    m->cart.end_frame();
+    double t1 = now_sec();
+    if(save.flush(&write_save_file, fp) > 0) fflush(fp);
+    flush_time += now_sec() - t1;
+  }
+  // 終了時は書き込みが止まるのを待たずに残りを書き込む
+  while(save.is_dirty()){
+    save.request_flush();
+    m->cart.end_frame();
+    if(save.flush(&write_save_file, fp) > 0) fflush(fp);
+  }
+  double sec = now_sec() - t0;
+  fclose(fp);
+
+  printf("[save] %s (%u bytes, %s)\n", path, save.file_size(), loaded ? "loaded" : "created");
+  printf("  %u frames, %.3f s\n", frames, sec);
+  printf("  flushes    : %u (%u pages, %u errors)\n", save.flushes, save.pages, save.errors);
+  printf("  file write : %.1f us\n", flush_time * 1e6);
+  delete m;
+  return 0;
+}
+
+int main(int argc, char **argv){
+  std::vector<uint8_t> empty(0x8000, 0x00);
+  RomImage rom = {empty.data(), (uint32_t)empty.size()};
+  uint32_t frames = 600;
+  const char *golden = nullptr;
+  const char *save = nullptr;
+  bool update = false;
+  const char *rom_path = nullptr;
+
+  // オプション以外の引数は順に ROMファイル・フレーム数
+  uint8_t _pos = 0;
+  for(int i = 1; i < argc; i++){
+    if(strcmp(argv[i], "--golden") == 0 && i + 1 < argc) golden = argv[++i];
+    else if(strcmp(argv[i], "--update") == 0) update = true;
+    else if(strcmp(argv[i], "--save") == 0 && i + 1 < argc) save = argv[++i];
+    else if(_pos++ == 0) rom_path = argv[i];
+    else frames = (uint32_t)atoi(argv[i]);
+  }
+  if(golden != nullptr && _pos < 2) frames = 16;
+
+  // ROMファイルは mmap で参照し、できない場合（32KB未満・通常のファイル以外）はコピーする
+  std::vector<uint8_t> copied;
+  if(rom_path != nullptr && !map_rom(rom_path, rom)){
+    if(!copy_rom(rom_path, copied)){
+      fprintf(stderr, "cannot open %s\n", rom_path);
+      return 1;
+    }
+    rom = {copied.data(), (uint32_t)copied.size()};
+  }
+
+  if(golden != nullptr) return run_golden(golden, update, rom_path ? &rom : nullptr, frames);
+  if(save != nullptr) return run_save(save, rom, frames);
+
+  if(rom_path != nullptr) bench_startup(rom_path);
+  bench_rom(rom, frames);
+  bench_kernels(frames);
+  bench_render(frames);
+  bench_scale(frames);
+  return 0;
+}